@@ -21,6 +21,8 @@ int main (int    argc,
   instrument = lyd_compile (lyd, "sin(hz=440) * volume=1");
 
   voice = lyd_voice_new (lyd, instrument, 0.0, 0);
+  if (!voice)
+    return -1;
   lyd_voice_set_param (voice, "volume", 1.2);
   lyd_voice_set_duration (voice, 10.0);
 
@@ -27,6 +27,8 @@ int main (int    argc, char **argv)
   for (i = 0; i<14;i++)
     {
       voice = lyd_voice_new (lyd, instrument, 0.3 * i, 0);
+      if (!voice)
+        break;
       lyd_voice_set_param (voice, "hz", scale[i]);
       lyd_voice_set_duration (voice, 0.2);
     }
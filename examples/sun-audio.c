@@ -29,6 +29,7 @@ static float midi2hz (int midinote)
 
 #define NOTE(time, duration, halfnote) do{                         \
   voice = lyd_voice_new (lyd, instrument, time, 0);                \
+  if (!voice) break;                                               \
   lyd_voice_set_param (voice, "hz",     midi2hz(halfnote+69));\
   lyd_voice_set_duration (voice, duration);         }while(0);
 
@@ -52,7 +52,7 @@ int main (int    argc,
           LydVoice   *voice;
           char        code[1024];
 
-          switch(rand()%9)
+          switch(rand()%10)
             {
               case 0: /* plain playback */
                 sprintf (code, "wave('%s') * volume", wavpath);
@@ -82,11 +82,19 @@ int main (int    argc,
               case 8: /* vibrato */
                 sprintf (code, "wave('%s') * sin(4) * 2 * volume", wavpath);
                 break;
+              case 9: /* granular cloud, dense without a voice per grain */
+                sprintf (code, "grains('%s', 150, 0.3 + sin(0.2) * 0.2, 1.0, 0.02, 0.08, 0.02) * 0.3 * volume", wavpath);
+                break;
               /* with band pass*/
             }
 
           instrument = lyd_compile (lyd, code);
           voice = lyd_voice_new (lyd, instrument, 0.0, 0);
+          if (!voice) /* over the memory budget */
+            {
+              lyd_program_free (instrument);
+              continue;
+            }
 
           /* any variable (that is non-reserved keyword) in the source can be manipulated
            * in realtime like this: 
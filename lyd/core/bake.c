@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2010 Øyvind Kolås <pippin@gimp.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Wavetables for the baked() op, this file is included from lyd-ops.c.
+ *
+ * The compiler replaces stacks of oscillators running at integer ratios of
+ * the same frequency, combined with plain math on constants, by baked(hz,
+ * index). Such a stack is a fixed function of the phase of its fundamental;
+ * the compiler samples one cycle of it, oversampled to keep the edges of saw
+ * and square waves from folding, and it is turned into band limited copies
+ * an octave apart with a FFT here. Playback picks the copy that has no
+ * harmonics above nyquist for the current frequency.
+ */
+
+struct _LydBake
+{
+  float     ratio; /* of the fundamental to the hz argument */
+  LydSample data[LYD_BAKE_LEVELS][LYD_BAKE_SIZE + 1]; /* the extra sample
+                                    repeats the first, for interpolation */
+};
+
+/* in place complex transform of n values, n a power of two */
+static void bake_fft (float *re, float *im, int n, int inverse)
+{
+  int i, j, len;
+
+  for (i = 1, j = 0; i < n; i++)
+    {
+      int bit = n >> 1;
+      for (; j & bit; bit >>= 1)
+        j ^= bit;
+      j ^= bit;
+      if (i < j)
+        {
+          float t;
+          t = re[i]; re[i] = re[j]; re[j] = t;
+          t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+
+  for (len = 2; len <= n; len *= 2)
+    {
+      int half = len / 2;
+      int k, start;
+      for (k = 0; k < half; k++)
+        {
+          float wr = cos (2 * M_PI * k / len);
+          float wi = (inverse ? 1 : -1) * sin (2 * M_PI * k / len);
+          for (start = 0; start < n; start += len)
+            {
+              int   a = start + k, b = a + half;
+              float tr = re[b] * wr - im[b] * wi;
+              float ti = re[b] * wi + im[b] * wr;
+              re[b] = re[a] - tr;
+              im[b] = im[a] - ti;
+              re[a] += tr;
+              im[a] += ti;
+            }
+        }
+    }
+}
+
+/* the waveforms of the oscillator ops, for a phase 0.0 to 1.0 */
+float lyd_bake_oscillator (LydOpCode op, float p)
+{
+  switch (op)
+    {
+      case LYD_SIN:        return sinf (p * M_PI * 2);
+      case LYD_SAW:        return p * 2 - 1.0;
+      case LYD_RAMP:       return -(p * 2 - 1.0);
+      case LYD_SQUARE:     return p > 0.5 ? 1.0 : -1.0;
+      case LYD_TRIANGLE:   return p < 0.25 ? p * 4 : p < 0.75 ? 2 - p * 4
+                                                                : -4 + p * 4;
+      case LYD_ABSSIN:     return fabsf (sinf (p * M_PI * 2));
+      case LYD_POSSIN:     return p < 0.5 ? sinf (p * M_PI * 2) : 0.0;
+      case LYD_PULSSIN:    return fmodf (p, 0.5) < 0.25 ?
+                                  fabsf (sinf (p * M_PI * 2)) : 0.0;
+      case LYD_EVENSIN:    return p < 0.5 ? sinf (2 * p * M_PI * 2) : 0.0;
+      case LYD_EVENPOSSIN: return p < 0.5 ? fabsf (sinf (2 * p * M_PI * 2))
+                                          : 0.0;
+      default:             return 0.0;
+    }
+}
+
+/* harmonics kept in each band limited copy */
+static inline int bake_harmonics (int level)
+{
+  return level ? (LYD_BAKE_SIZE / 2) >> level : LYD_BAKE_SIZE / 2 - 1;
+}
+
+LydBake *lyd_bake_new (const float *cycle, float ratio)
+{
+  const int  n = LYD_BAKE_SIZE * LYD_BAKE_OVERSAMPLE;
+  LydBake   *bake = g_malloc (sizeof (LydBake));
+  float     *re  = g_malloc (sizeof (float) * n);
+  float     *im  = g_malloc (sizeof (float) * n);
+  float     *tre = g_malloc (sizeof (float) * LYD_BAKE_SIZE);
+  float     *tim = g_malloc (sizeof (float) * LYD_BAKE_SIZE);
+  int        i, level;
+
+  bake->ratio = ratio;
+  for (i = 0; i < n; i++)
+    {
+      re[i] = cycle[i];
+      im[i] = 0.0;
+    }
+  bake_fft (re, im, n, 0);
+
+  for (level = 0; level < LYD_BAKE_LEVELS; level++)
+    {
+      int harmonics = bake_harmonics (level);
+      for (i = 0; i < LYD_BAKE_SIZE; i++)
+        tre[i] = tim[i] = 0.0;
+      tre[0] = re[0] / n;
+      for (i = 1; i <= harmonics; i++)
+        {
+          tre[i] = re[i] / n;
+          tim[i] = im[i] / n;
+          tre[LYD_BAKE_SIZE - i] = re[i] / n;
+          tim[LYD_BAKE_SIZE - i] = -im[i] / n;
+        }
+      bake_fft (tre, tim, LYD_BAKE_SIZE, 1);
+      for (i = 0; i < LYD_BAKE_SIZE; i++)
+        bake->data[level][i] = tre[i];
+      bake->data[level][LYD_BAKE_SIZE] = tre[0];
+    }
+
+  g_free (re);
+  g_free (im);
+  g_free (tre);
+  g_free (tim);
+  return bake;
+}
+
+void lyd_bake_free (LydBake *bake)
+{
+  g_free (bake);
+}
+
+static inline void op_baked (OP_ARGS)
+{
+  LydProgram *program = vm->program;
+  int         no = state->arg[1][0];
+  LydBake    *bake = no >= 0 && no < program->n_bake ? program->bake[no]
+                                                    : NULL;
+  float       hz = 0.0, step, limit;
+  LydSample  *data;
+  int         i, level;
+  ALIGNED_ARGS;
+
+  if (!bake)
+    {
+      memset (state->out, 0, sizeof (LydSample) * samples);
+      return;
+    }
+
+  /* the copy with the most harmonics that stay below nyquist */
+  for (i = 0; i < samples; i++)
+    if (fabsf (ARG(0)) > hz)
+      hz = fabsf (ARG(0));
+  limit = hz > 0.0 ? 0.5 * vm->sample_rate / (hz * bake->ratio)
+                   : LYD_BAKE_SIZE;
+  for (level = 0; level < LYD_BAKE_LEVELS - 1 &&
+                  bake_harmonics (level) > limit; level++);
+  data = bake->data[level];
+
+  step = bake->ratio * vm->i_sample_rate;
+  for (i = 0; i < samples; i++)
+    {
+      float p   = state->phase;
+      float pos = p * LYD_BAKE_SIZE;
+      int   j   = pos;
+
+      OUT = data[j] + (data[j + 1] - data[j]) * (pos - j);
+
+      p += ARG(0) * step;
+      p -= (int)p;
+      if (p < 0.0)
+        p += 1.0;
+      if (p >= 1.0)
+        p = 0.0;
+      state->phase = p;
+    }
+  ALIGNED_ARGS_SILENCE;
+}
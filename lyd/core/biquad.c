@@ -33,7 +33,7 @@ typedef struct {
     smp_type dbGain;
     smp_type freq;
     smp_type bandwidth;
-    /* assuming srate to be constant */
+    smp_type srate;
     smp_type a0, a1, a2, a3, a4; /* cached for update */
     smp_type x1, x2, y1, y2;
 }
@@ -83,6 +83,7 @@ smp_type srate, smp_type bandwidth)
     b->dbGain = dbGain;
     b->freq = freq;
     b->bandwidth = bandwidth;
+    b->srate = srate;
 
     /* setup variables */
     A = pow(10, dbGain /40);
@@ -163,6 +164,117 @@ smp_type srate, smp_type bandwidth)
     return b;
 }
 
+/* Computes a block of samples with constant coefficients.
+ *
+ * The feed forward part is done for the whole block first, the feedback
+ * part then produces four outputs per step from the look-ahead (state
+ * space) form of the recursion
+ *
+ *   y[n+k] = v[n+k] + h1 v[n+k-1] + .. + hk v[n] + p[k] y[n-1] + q[k] y[n-2]
+ *
+ * where h is the impulse response of the feedback part and p, q its
+ * response to the two state samples. The four outputs of a step only
+ * depend on the previous step through y[n-1] and y[n-2], which shortens
+ * the dependency chain that bounds the scalar BiQuad() to a quarter.
+ */
+#define BIQUAD_STEP 4
+static void BiQuad_block(biquad *b, const smp_type *in, smp_type *out,
+int samples)
+{
+    smp_type c1 = b->a3, c2 = b->a4;
+    smp_type y1 = b->y1, y2 = b->y2;
+    smp_type h[BIQUAD_STEP+2], p[BIQUAD_STEP+2], q[BIQUAD_STEP+2];
+    smp_type m[BIQUAD_STEP][BIQUAD_STEP] __attribute__ ((aligned (16)));
+    int i, j, k;
+
+    if (samples < 2) {
+        for (i = 0; i < samples; i++)
+            out[i] = BiQuad(in[i], b);
+        return;
+    }
+
+    /* feed forward part */
+    out[0] = b->a0 * in[0] + b->a1 * b->x1 + b->a2 * b->x2;
+    out[1] = b->a0 * in[1] + b->a1 * in[0] + b->a2 * b->x1;
+    for (i = 2; i < samples; i++)
+        out[i] = b->a0 * in[i] + b->a1 * in[i-1] + b->a2 * in[i-2];
+    b->x1 = in[samples-1];
+    b->x2 = in[samples-2];
+
+    /* responses to an impulse and to the two state samples, the first
+     * two entries hold the initial conditions */
+    h[0] = 0; h[1] = 1;
+    p[0] = 0; p[1] = 1;
+    q[0] = 1; q[1] = 0;
+    for (k = 2; k < BIQUAD_STEP + 2; k++) {
+        h[k] = -c1 * h[k-1] - c2 * h[k-2];
+        p[k] = -c1 * p[k-1] - c2 * p[k-2];
+        q[k] = -c1 * q[k-1] - c2 * q[k-2];
+    }
+    /* m[j][k], contribution of v[n+j] to y[n+k] */
+    for (j = 0; j < BIQUAD_STEP; j++)
+        for (k = 0; k < BIQUAD_STEP; k++)
+            m[j][k] = k >= j ? h[k - j + 1] : 0;
+
+    /* feedback part */
+    for (i = 0; i + BIQUAD_STEP <= samples; i += BIQUAD_STEP) {
+        smp_type y[BIQUAD_STEP] __attribute__ ((aligned (16)));
+        for (k = 0; k < BIQUAD_STEP; k++)
+            y[k] = p[k+2] * y1 + q[k+2] * y2;
+        for (j = 0; j < BIQUAD_STEP; j++)
+            for (k = 0; k < BIQUAD_STEP; k++)
+                y[k] += m[j][k] * out[i+j];
+        for (k = 0; k < BIQUAD_STEP; k++)
+            out[i+k] = y[k];
+        y1 = y[BIQUAD_STEP-1];
+        y2 = y[BIQUAD_STEP-2];
+    }
+    for (; i < samples; i++) {
+        smp_type result = out[i] - c1 * y1 - c2 * y2;
+        y2 = y1;
+        y1 = result;
+        out[i] = result;
+    }
+    b->y1 = y1;
+    b->y2 = y2;
+}
+
+/* Returns non zero if the parameters differ from the ones the coefficients
+ * were computed for */
+static inline int BiQuad_changed(biquad *b, smp_type dbGain, smp_type freq,
+smp_type srate, smp_type bandwidth)
+{
+    return b->dbGain != dbGain || b->freq != freq ||
+           b->srate != srate || b->bandwidth != bandwidth;
+}
+
+/* Filters a block of samples while moving the coefficients linearly
+ * from the ones in from[] to the current ones, instead of stepping */
+static void BiQuad_ramp(biquad *b, const smp_type *from,
+const smp_type *in, smp_type *out, int samples)
+{
+    smp_type a0 = from[0], a1 = from[1], a2 = from[2],
+             a3 = from[3], a4 = from[4];
+    smp_type d0 = (b->a0 - a0) / samples, d1 = (b->a1 - a1) / samples,
+             d2 = (b->a2 - a2) / samples, d3 = (b->a3 - a3) / samples,
+             d4 = (b->a4 - a4) / samples;
+    smp_type x1 = b->x1, x2 = b->x2, y1 = b->y1, y2 = b->y2;
+    int i;
+
+    for (i = 0; i < samples; i++) {
+        smp_type result;
+        a0 += d0; a1 += d1; a2 += d2; a3 += d3; a4 += d4;
+        result = a0 * in[i] + a1 * x1 + a2 * x2 - a3 * y1 - a4 * y2;
+        x2 = x1;
+        x1 = in[i];
+        y2 = y1;
+        y1 = result;
+        out[i] = result;
+    }
+    b->x1 = x1; b->x2 = x2;
+    b->y1 = y1; b->y2 = y2;
+}
+
 /* sets up a BiQuad Filter */
 static biquad *BiQuad_new(int type, smp_type dbGain, smp_type freq,
 smp_type srate, smp_type bandwidth)
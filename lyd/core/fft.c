@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2010 Øyvind Kolås <pippin@gimp.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Fixed size radix-2 FFT of real signals, used by the convolution op, this
+ * file is included from lyd-ops.c.
+ *
+ * Spectra are kept split, FFT_BINS real parts followed by FFT_BINS
+ * imaginary parts at FFT_STRIDE, only the non negative frequencies of the
+ * (conjugate symmetric) spectrum are stored.
+ */
+
+#define FFT_SIZE    (LYD_CHUNK * 2)
+#define FFT_BINS    (FFT_SIZE / 2 + 1)
+#define FFT_STRIDE  ((FFT_BINS + 3) & ~3)   /* keep imaginary parts aligned */
+
+static float fft_cos[FFT_SIZE / 2];
+static float fft_sin[FFT_SIZE / 2];
+static short fft_rev[FFT_SIZE];
+
+static void fft_init (void)
+{
+  int i, bits = 0;
+  while ((1 << bits) < FFT_SIZE)
+    bits++;
+  for (i = 0; i < FFT_SIZE / 2; i++)
+    {
+      fft_cos[i] = cos (2 * M_PI * i / FFT_SIZE);
+      fft_sin[i] = -sin (2 * M_PI * i / FFT_SIZE);
+    }
+  for (i = 0; i < FFT_SIZE; i++)
+    {
+      int j, r = 0;
+      for (j = 0; j < bits; j++)
+        if (i & (1 << j))
+          r |= 1 << (bits - 1 - j);
+      fft_rev[i] = r;
+    }
+}
+
+/* in place complex transform, forward or (unscaled) inverse */
+static void fft_complex (float *re, float *im, int inverse)
+{
+  int i, len;
+
+  for (i = 0; i < FFT_SIZE; i++)
+    if (i < fft_rev[i])
+      {
+        float t;
+        t = re[i]; re[i] = re[fft_rev[i]]; re[fft_rev[i]] = t;
+        t = im[i]; im[i] = im[fft_rev[i]]; im[fft_rev[i]] = t;
+      }
+
+  for (len = 2; len <= FFT_SIZE; len *= 2)
+    {
+      int half = len / 2;
+      int step = FFT_SIZE / len;
+      int start, k;
+      for (start = 0; start < FFT_SIZE; start += len)
+        for (k = 0; k < half; k++)
+          {
+            float wr = fft_cos[k * step];
+            float wi = inverse ? -fft_sin[k * step] : fft_sin[k * step];
+            int   a = start + k, b = a + half;
+            float tr = re[b] * wr - im[b] * wi;
+            float ti = re[b] * wi + im[b] * wr;
+            re[b] = re[a] - tr;
+            im[b] = im[a] - ti;
+            re[a] += tr;
+            im[a] += ti;
+          }
+    }
+}
+
+/* spectrum of FFT_SIZE real samples */
+static void fft_forward (const float *in, float *spectrum)
+{
+  float re[FFT_SIZE], im[FFT_SIZE];
+  int i;
+  for (i = 0; i < FFT_SIZE; i++)
+    {
+      re[i] = in[i];
+      im[i] = 0.0;
+    }
+  fft_complex (re, im, 0);
+  for (i = 0; i < FFT_BINS; i++)
+    {
+      spectrum[i] = re[i];
+      spectrum[FFT_STRIDE + i] = im[i];
+    }
+}
+
+/* FFT_SIZE real samples of spectrum, scaled by FFT_SIZE */
+static void fft_inverse (const float *spectrum, float *out)
+{
+  float re[FFT_SIZE], im[FFT_SIZE];
+  int i;
+  for (i = 0; i < FFT_BINS; i++)
+    {
+      re[i] = spectrum[i];
+      im[i] = spectrum[FFT_STRIDE + i];
+    }
+  for (; i < FFT_SIZE; i++)
+    {
+      re[i] = spectrum[FFT_SIZE - i];
+      im[i] = -spectrum[FFT_STRIDE + FFT_SIZE - i];
+    }
+  fft_complex (re, im, 1);
+  for (i = 0; i < FFT_SIZE; i++)
+    out[i] = re[i];
+}
@@ -0,0 +1,459 @@
+/*
+ * Copyright (c) 2010 Øyvind Kolås <pippin@gimp.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Memory management for lyd, the LYD_CHUNK sized sample buffers used by
+ * the vm and the larger delay line allocations of ops.
+ *
+ * Chunks are carved out of slabs of LYD_SLAB_SIZE bytes, aligned to their
+ * own size so that the slab header (living in the first chunk slot) is
+ * found by masking a chunk address, this makes freeing O(1). Slabs in turn
+ * are carved out of mmaped arenas of LYD_ARENA_SIZE, that optionally are
+ * backed by huge pages to reduce TLB pressure.
+ *
+ * Every thread keeps a small magazine of free chunks, allocating and
+ * freeing only touches the magazine. The lyd wide depot, protected by
+ * lyd->mmutex, is only visited when a magazine runs empty or full and then
+ * half a magazine of chunks is moved in one go.
+ *
+ * A magazine caches chunks of one lyd at a time and outlives it, it stays
+ * with its thread until the thread exits. All magazines are kept in a
+ * registry, switching a magazine to another lyd or handing its chunks back
+ * on thread exit is done with the registry lock held, so that a lyd being
+ * freed can take its chunks out of the magazines of every thread.
+ *
+ * lyd_trim drops the freed voices programs keep for reuse, returns slabs
+ * whose chunks all are back in the depot, and unmaps arenas without any
+ * slabs left in use.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "lyd-private.h"
+
+#define LYD_CHUNK_BYTES    (sizeof (LydSample) * LYD_CHUNK)
+#define LYD_SLAB_CHUNKS    (LYD_SLAB_SIZE / LYD_CHUNK_BYTES - 1)
+#define LYD_MAGAZINE_SIZE  32
+#define LYD_HUGE_PAGE      (2 * 1024 * 1024)
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+typedef struct _LydSlab LydSlab;
+
+struct _LydArena
+{
+  LydArena *next;
+  void     *map;         /* the mapping, munmapped when no slabs are live */
+  size_t    map_size;
+  char     *base;        /* first slab, aligned to LYD_SLAB_SIZE */
+  int       slabs;       /* number of slabs fitting in the arena */
+  int       carved;      /* slabs handed out from base so far */
+  int       live;        /* slabs currently in use */
+  int       huge;        /* backed by MAP_HUGETLB pages */
+  LydSlab  *free_slabs;  /* trimmed slabs available for reuse */
+};
+
+struct _LydSlab
+{
+  Lyd           *lyd;
+  LydArena      *arena;
+  LydSlab       *next_free;  /* link in arena->free_slabs */
+  int            free_count; /* scratch used when trimming */
+  unsigned char  in_use[LYD_SLAB_CHUNKS]; /* for ignoring double frees */
+};
+
+typedef struct _LydMagazine LydMagazine;
+
+struct _LydMagazine
+{
+  Lyd         *lyd;        /* the lyd the cached chunks belong to */
+  int          count;
+  LydSample   *chunk[LYD_MAGAZINE_SIZE];
+  LydMagazine *next;       /* link in the registry */
+  int          registered;
+};
+
+static __thread LydMagazine magazine;
+static pthread_key_t        magazine_key;
+static pthread_once_t       magazine_once = PTHREAD_ONCE_INIT;
+static LydMagazine         *magazines;  /* registry of all threads' */
+static pthread_mutex_t      magazines_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define SLAB_OF(chunk) \
+  ((LydSlab*)(((uintptr_t)(chunk)) & ~((uintptr_t)LYD_SLAB_SIZE - 1)))
+#define CHUNK_NO(slab, chunk) \
+  ((((char*)(chunk)) - ((char*)(slab))) / LYD_CHUNK_BYTES - 1)
+/* free chunks in the depot are linked through their first bytes */
+#define NEXT_FREE(chunk)  (*(LydSample**)(chunk))
+
+static void lyd_magazine_flush (LydMagazine *mag, int keep);
+
+/* thread exit, hand the chunks back and leave the registry */
+static void lyd_magazine_destroy (void *data)
+{
+  LydMagazine  *mag = data;
+  LydMagazine **link;
+
+  pthread_mutex_lock (&magazines_mutex);
+  lyd_magazine_flush (mag, 0);
+  for (link = &magazines; *link != mag; link = &(*link)->next);
+  *link = mag->next;
+  mag->registered = 0;
+  __atomic_store_n (&mag->lyd, NULL, __ATOMIC_RELAXED);
+  pthread_mutex_unlock (&magazines_mutex);
+}
+
+static void lyd_magazine_key_init (void)
+{
+  pthread_key_create (&magazine_key, lyd_magazine_destroy);
+}
+
+/* make the calling thread's magazine belong to lyd */
+static inline LydMagazine *lyd_magazine (Lyd *lyd)
+{
+  LydMagazine *mag = &magazine;
+  /* only the owning thread changes lyd, other threads clear it when the
+   * lyd is freed */
+  if (G_UNLIKELY (__atomic_load_n (&mag->lyd, __ATOMIC_RELAXED) != lyd))
+    {
+      pthread_mutex_lock (&magazines_mutex);
+      if (!mag->registered)
+        {
+          /* first use in this thread, hand chunks back on thread exit */
+          pthread_once (&magazine_once, lyd_magazine_key_init);
+          pthread_setspecific (magazine_key, mag);
+          mag->next = magazines;
+          magazines = mag;
+          mag->registered = 1;
+        }
+      lyd_magazine_flush (mag, 0);
+      __atomic_store_n (&mag->lyd, lyd, __ATOMIC_RELAXED);
+      pthread_mutex_unlock (&magazines_mutex);
+    }
+  return mag;
+}
+
+static LydArena *lyd_arena_new_unlocked (Lyd *lyd)
+{
+  LydArena *arena;
+  size_t    size = LYD_ARENA_SIZE;
+  void     *map  = MAP_FAILED;
+  int       huge = 0;
+
+#ifdef MAP_HUGETLB
+  if (lyd->hugepages)
+    {
+      map = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      huge = map != MAP_FAILED;
+    }
+#endif
+  if (map == MAP_FAILED)
+    {
+      size += LYD_SLAB_SIZE; /* slack for aligning the slabs */
+      map = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (map == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+      if (lyd->hugepages) /* fall back to transparent huge pages */
+        madvise (map, size, MADV_HUGEPAGE);
+#endif
+    }
+
+  arena = g_new0 (LydArena, 1);
+  arena->map = map;
+  arena->map_size = size;
+  arena->huge = huge;
+  arena->base = (void*)((((uintptr_t)map) + LYD_SLAB_SIZE - 1) &
+                        ~((uintptr_t)LYD_SLAB_SIZE - 1));
+  arena->slabs = (((char*)map) + size - arena->base) / LYD_SLAB_SIZE;
+  arena->next = lyd->arenas;
+  lyd->arenas = arena;
+  return arena;
+}
+
+static void lyd_slab_new_unlocked (Lyd *lyd)
+{
+  LydArena *arena;
+  LydSlab  *slab = NULL;
+  int       no;
+
+  for (arena = lyd->arenas; arena; arena = arena->next)
+    if (arena->free_slabs || arena->carved < arena->slabs)
+      break;
+  if (!arena && !(arena = lyd_arena_new_unlocked (lyd)))
+    return;
+
+  if (arena->free_slabs)
+    {
+      slab = arena->free_slabs;
+      arena->free_slabs = slab->next_free;
+    }
+  else
+    slab = (void*)(arena->base + LYD_SLAB_SIZE * arena->carved++);
+  arena->live++;
+
+  memset (slab, 0, sizeof (LydSlab));
+  slab->lyd = lyd;
+  slab->arena = arena;
+  lyd->chunk_pools = slist_prepend (lyd->chunk_pools, slab);
+  __sync_fetch_and_add (&lyd->mem_used, LYD_SLAB_SIZE);
+
+  for (no = LYD_SLAB_CHUNKS - 1; no >= 0; no--)
+    {
+      LydSample *chunk = (void*)(((char*)slab) + (no + 1) * LYD_CHUNK_BYTES);
+      NEXT_FREE (chunk) = lyd->chunk_free;
+      lyd->chunk_free = chunk;
+    }
+}
+
+/* give a slab without chunks in use back to its arena, and the arena back
+ * to the system when it has no slabs left in use */
+static void lyd_slab_release_unlocked (Lyd *lyd, LydSlab *slab)
+{
+  LydArena *arena = slab->arena;
+
+  lyd->chunk_pools = slist_remove (lyd->chunk_pools, slab);
+  __sync_fetch_and_sub (&lyd->mem_used, LYD_SLAB_SIZE);
+
+  if (--arena->live == 0)
+    {
+      LydArena **link;
+      for (link = &lyd->arenas; *link != arena; link = &(*link)->next);
+      *link = arena->next;
+      munmap (arena->map, arena->map_size);
+      g_free (arena);
+      return;
+    }
+  if (!arena->huge) /* return the pages, keeping the address range */
+    madvise (slab, LYD_SLAB_SIZE, MADV_DONTNEED);
+  slab->next_free = arena->free_slabs;
+  arena->free_slabs = slab;
+}
+
+/* move chunks from the depot to the magazine, until it is half full */
+static void lyd_magazine_refill (LydMagazine *mag)
+{
+  Lyd *lyd = mag->lyd;
+  pthread_mutex_lock (&lyd->mmutex);
+  while (mag->count < LYD_MAGAZINE_SIZE / 2)
+    {
+      if (!lyd->chunk_free)
+        {
+          lyd_slab_new_unlocked (lyd);
+          if (!lyd->chunk_free)
+            break;
+        }
+      mag->chunk[mag->count++] = lyd->chunk_free;
+      lyd->chunk_free = NEXT_FREE (lyd->chunk_free);
+    }
+  pthread_mutex_unlock (&lyd->mmutex);
+}
+
+/* move chunks from the magazine to the depot, until keep are left */
+static void lyd_magazine_flush (LydMagazine *mag, int keep)
+{
+  Lyd *lyd = mag->lyd;
+  if (!lyd || mag->count <= keep)
+    return;
+  pthread_mutex_lock (&lyd->mmutex);
+  while (mag->count > keep)
+    {
+      LydSample *chunk = mag->chunk[--mag->count];
+      NEXT_FREE (chunk) = lyd->chunk_free;
+      lyd->chunk_free = chunk;
+    }
+  pthread_mutex_unlock (&lyd->mmutex);
+}
+
+LydSample *lyd_chunk_new (Lyd *lyd)
+{
+  LydMagazine *mag = lyd_magazine (lyd);
+  LydSample   *chunk;
+  LydSlab     *slab;
+
+  if (G_UNLIKELY (mag->count == 0))
+    {
+      lyd_magazine_refill (mag);
+      if (!mag->count)
+        return NULL;
+    }
+  chunk = mag->chunk[--mag->count];
+  slab = SLAB_OF (chunk);
+  slab->in_use[CHUNK_NO (slab, chunk)] = 1;
+  memset (chunk, 0, LYD_CHUNK_BYTES);
+  return chunk;
+}
+
+void lyd_chunk_free (Lyd *lyd, LydSample *chunk)
+{
+  LydMagazine *mag;
+  LydSlab     *slab;
+
+  if (!chunk)
+    return;
+  slab = SLAB_OF (chunk);
+  /* aliased chunks may be handed back more than once, only the first
+   * free counts */
+  if (!__atomic_exchange_n (&slab->in_use[CHUNK_NO (slab, chunk)], 0,
+                           __ATOMIC_ACQ_REL))
+    return;
+
+  mag = lyd_magazine (slab->lyd);
+  if (G_UNLIKELY (mag->count == LYD_MAGAZINE_SIZE))
+    lyd_magazine_flush (mag, LYD_MAGAZINE_SIZE / 2);
+  mag->chunk[mag->count++] = chunk;
+}
+
+long lyd_trim (Lyd *lyd)
+{
+  LydSample *chunk, *keep = NULL;
+  SList     *iter;
+  long       before;
+
+  /* voices kept for reuse hold on to chunks */
+  lyd_programs_flush (lyd, 0);
+
+  /* chunks cached by the calling thread can be trimmed as well */
+  if (magazine.lyd == lyd)
+    lyd_magazine_flush (&magazine, 0);
+
+  pthread_mutex_lock (&lyd->mmutex);
+  before = lyd->mem_used;
+
+  for (iter = lyd->chunk_pools; iter; iter = iter->next)
+    ((LydSlab*)iter->data)->free_count = 0;
+  for (chunk = lyd->chunk_free; chunk; chunk = NEXT_FREE (chunk))
+    SLAB_OF (chunk)->free_count++;
+
+  /* rebuild the depot from chunks of slabs that stay */
+  while ((chunk = lyd->chunk_free))
+    {
+      lyd->chunk_free = NEXT_FREE (chunk);
+      if (SLAB_OF (chunk)->free_count < LYD_SLAB_CHUNKS)
+        {
+          NEXT_FREE (chunk) = keep;
+          keep = chunk;
+        }
+    }
+  lyd->chunk_free = keep;
+
+  for (iter = lyd->chunk_pools; iter;)
+    {
+      LydSlab *slab = iter->data;
+      iter = iter->next;
+      if (slab->free_count == LYD_SLAB_CHUNKS)
+        lyd_slab_release_unlocked (lyd, slab);
+    }
+  pthread_mutex_unlock (&lyd->mmutex);
+
+  return before - lyd->mem_used;
+}
+
+/* releases all memory of the chunk allocator, chunks still held by voices
+ * become invalid */
+void lyd_chunks_destroy (Lyd *lyd)
+{
+  LydMagazine *mag;
+
+  /* empty the magazines of every thread still caching chunks of lyd, the
+   * chunks themselves go with the arenas */
+  pthread_mutex_lock (&magazines_mutex);
+  for (mag = magazines; mag; mag = mag->next)
+    if (__atomic_load_n (&mag->lyd, __ATOMIC_RELAXED) == lyd)
+      {
+        mag->count = 0;
+        __atomic_store_n (&mag->lyd, NULL, __ATOMIC_RELAXED);
+      }
+  pthread_mutex_unlock (&magazines_mutex);
+
+  while (lyd->arenas)
+    {
+      LydArena *arena = lyd->arenas;
+      lyd->arenas = arena->next;
+      munmap (arena->map, arena->map_size);
+      g_free (arena);
+    }
+  slist_free (lyd->chunk_pools);
+  lyd->chunk_pools = NULL;
+  lyd->chunk_free = NULL;
+}
+
+/* allocations larger than this are mmaped directly, making them page
+ * aligned and returned to the system immediately when freed */
+#define LYD_MEM_MMAP_THRESHOLD  LYD_SLAB_SIZE
+
+typedef struct _LydMemHeader
+{
+  size_t size;
+  size_t padding; /* keeps the data LYD_ALIGN aligned */
+} LydMemHeader;
+
+void *lyd_mem_alloc (Lyd *lyd, size_t size)
+{
+  LydMemHeader *header;
+  size += sizeof (LydMemHeader);
+
+  if (size >= LYD_MEM_MMAP_THRESHOLD)
+    {
+      header = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (header == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+      if (lyd->hugepages && size >= LYD_HUGE_PAGE)
+        madvise (header, size, MADV_HUGEPAGE);
+#endif
+    }
+  else if (!(header = g_malloc0 (size)))
+    return NULL;
+
+  header->size = size;
+  __sync_fetch_and_add (&lyd->mem_used, size);
+  return header + 1;
+}
+
+void lyd_mem_free (Lyd *lyd, void *mem)
+{
+  LydMemHeader *header;
+  if (!mem)
+    return;
+  header = ((LydMemHeader*)mem) - 1;
+  __sync_fetch_and_sub (&lyd->mem_used, header->size);
+  if (header->size >= LYD_MEM_MMAP_THRESHOLD)
+    munmap (header, header->size);
+  else
+    g_free (header);
+}
+
+long lyd_get_memory_used (Lyd *lyd)
+{
+  return __sync_fetch_and_add (&lyd->mem_used, 0);
+}
+
+void lyd_set_memory_budget (Lyd *lyd, long bytes)
+{
+  lyd->mem_budget = bytes;
+}
+
+void lyd_set_hugepages (Lyd *lyd, int enabled)
+{
+  lyd->hugepages = enabled;
+}
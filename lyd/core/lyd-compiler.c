@@ -16,6 +16,7 @@
 
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
 #include <stdio.h>
 #include "lyd-private.h"
 
@@ -25,8 +26,9 @@
  * I found that it also maps quite well to C.
  */
 
-/* XXX: leaking, what seems to be ) tokens, since they do not become part of
- * the tree.
+/* All tokens and their strings are allocated from an arena owned by the
+ * parser and released with it, trees are rewritten without freeing the
+ * parts that are dropped.
  */
 
 typedef struct {
@@ -76,9 +78,30 @@ struct _LydToken {
   int            command_no;
   LydToken      *first;
   LydToken      *second;
-  LydToken      *args[LYD_MAX_ARGC]; 
+  LydToken     **args;  /* arguments of function calls */
+  int            n_args;
+  int            args_size;
 };
 
+typedef struct _LydParserBlock LydParserBlock;
+
+struct _LydParserBlock {
+  LydParserBlock *next;
+  size_t          size;
+  size_t          used;
+};
+
+/* a name seen by the parser and what it was read as, looked up by hash so
+ * each name is resolved once per compile */
+typedef struct {
+  char         *key;        /* the word as scanned */
+  char         *str;        /* the name, without =default for variables */
+  unsigned int  hash;
+  LydToken     *symbol;     /* (fun), (var), (lit) or a grammar symbol */
+  float         value;
+  int           command_no; /* the nop holding a variable */
+} LydName;
+
 struct _LydParser  {
   Lyd        *lyd;
   LydToken   *token;
@@ -86,9 +109,18 @@ struct _LydParser  {
   const char *p;
   char       *error;
   int         variables;
-  float       variable[LYD_MAX_VARIABLES];
-  float       var_default[LYD_MAX_VARIABLES];
+  int         variables_size; /* allocated length of the arrays below */
+  float      *variable;       /* names of variables, hashed */
+  float      *var_default;
+  int         global_name; /* 2 after global, 1 after global( where the
+                              name of the modulator follows */
   LydToken   *tree;
+  LydBake    *bake[LYD_MAX_BAKED]; /* handed to the program */
+  int         n_bake;
+  LydParserBlock *blocks;  /* the arena, most recent block first */
+  LydName        *names;   /* open addressing table of names seen */
+  int             names_size;
+  int             n_names;
 };
 
 /* forward declarations */
@@ -99,8 +131,9 @@ static LydToken *nud_lparen  (LydParser *parser, LydToken *this);
 static LydToken *led_default (LydParser *parser, LydToken *this, LydToken *left);
 static LydToken *led_infix   (LydParser *parser, LydToken *this, LydToken *left);
 static LydToken *led_lparen  (LydParser *parser, LydToken *this, LydToken *left);
+static int       is_constant_tree (LydToken *t);
 
-#define COMMON 0, 0, NULL, NULL, {NULL,}
+#define COMMON 0, 0, NULL, NULL, NULL, 0
 
 /* When used as a symbol only the first 6 fields of the token are used. */
 static LydToken symbols[]= {
@@ -122,10 +155,76 @@ static LydToken symbols[]= {
 
 #undef COMMON
 
+#define N_ELEMENTS(a)  (sizeof(a)/sizeof(a[0]))
+
+/* the grammar symbols, constants and built in ops by name, a hash table
+ * filled on first use */
+typedef struct {
+  const char *str;
+  LydToken   *symbol;   /* grammar symbol, or NULL */
+  LydOpCode   op;       /* op of a function, or 0 */
+  float       constant; /* value of a named constant, or 0.0 */
+} LydLexeme;
+
+#define LEXICON_SIZE 256 /* power of two, at least twice the names */
+
+static LydLexeme      lexicon[LEXICON_SIZE];
+static pthread_once_t lexicon_once = PTHREAD_ONCE_INIT;
+
+static unsigned int name_hash (const char *str)
+{
+  unsigned int hash = 2166136261u;
+  for (; *str; str++)
+    hash = (hash ^ (unsigned char)*str) * 16777619u;
+  return hash;
+}
+
+static LydLexeme *lexicon_slot (const char *str)
+{
+  unsigned int i = name_hash (str) & (LEXICON_SIZE - 1);
+  while (lexicon[i].str && strcmp (lexicon[i].str, str))
+    i = (i + 1) & (LEXICON_SIZE - 1);
+  return &lexicon[i];
+}
+
+/* the first of symbols, constants and ops sharing a name is the one the
+ * parser reads it as */
+static void lexicon_init (void)
+{
+  LydLexeme   *lexeme;
+  unsigned int i;
+  for (i = 0; i < N_ELEMENTS (symbols); i++)
+    {
+      lexeme = lexicon_slot (symbols[i].str);
+      lexeme->str = symbols[i].str;
+      lexeme->symbol = &symbols[i];
+    }
+  for (i = 0; i < N_ELEMENTS (constant_lexicon); i++)
+    {
+      lexeme = lexicon_slot (constant_lexicon[i].str);
+      lexeme->str = constant_lexicon[i].str;
+      lexeme->constant = constant_lexicon[i].value;
+    }
+  for (i = 0; i < N_ELEMENTS (op_lexicon); i++)
+    {
+      lexeme = lexicon_slot (op_lexicon[i].str);
+      lexeme->str = op_lexicon[i].str;
+      if (!lexeme->op)
+        lexeme->op = op_lexicon[i].op;
+    }
+}
+
+static LydLexeme *lexicon_lookup (const char *str)
+{
+  LydLexeme *lexeme;
+  pthread_once (&lexicon_once, lexicon_init);
+  lexeme = lexicon_slot (str);
+  return lexeme->str ? lexeme : NULL;
+}
+
 /* forward declarations */
 static LydToken * parser_expression (LydParser *parser, int right_binding_power);
 static LydToken * parser_advance    (LydParser *parser, const char *str);
-static void token_free (LydToken *token);
 
 static LydToken *nud_default (LydParser *parser, LydToken *this)
 {
@@ -152,6 +251,62 @@ static LydToken *led_infix (LydParser *parser, LydToken *this, LydToken *left)
   return this;
 }
 
+#define PARSER_BLOCK_SIZE 4096
+
+/* zeroed memory that lives as long as the parser */
+static void *parser_alloc (LydParser *parser, size_t size)
+{
+  LydParserBlock *block = parser->blocks;
+  void           *mem;
+
+  size = (size + sizeof (void *) - 1) & ~(sizeof (void *) - 1);
+  if (!block || block->used + size > block->size)
+    {
+      size_t block_size = block ? block->size * 2 : PARSER_BLOCK_SIZE;
+      while (block_size < size)
+        block_size *= 2;
+      block = g_malloc (sizeof (LydParserBlock) + block_size);
+      block->next = parser->blocks;
+      block->size = block_size;
+      block->used = 0;
+      parser->blocks = block;
+    }
+  mem = (char *)(block + 1) + block->used;
+  block->used += size;
+  memset (mem, 0, size);
+  return mem;
+}
+
+static char *parser_strdup (LydParser *parser, const char *str)
+{
+  char *copy = parser_alloc (parser, strlen (str) + 1);
+  strcpy (copy, str);
+  return copy;
+}
+
+static LydToken *token_new (LydParser *parser, LydToken *symbol,
+                            const char *str)
+{
+  LydToken *t = parser_alloc (parser, sizeof (LydToken));
+  *t = *symbol;
+  t->str = (char *)str;
+  return t;
+}
+
+static void token_add_arg (LydParser *parser, LydToken *t, LydToken *arg)
+{
+  if (t->n_args == t->args_size)
+    {
+      LydToken **args;
+      t->args_size = t->args_size * 2 + 4;
+      args = parser_alloc (parser, sizeof (LydToken *) * t->args_size);
+      if (t->n_args)
+        memcpy (args, t->args, sizeof (LydToken *) * t->n_args);
+      t->args = args;
+    }
+  t->args[t->n_args++] = arg;
+}
+
 static LydToken *led_lparen (LydParser *parser, LydToken *this, LydToken *left)
 {
   this->type = args;
@@ -162,26 +317,56 @@ static LydToken *led_lparen (LydParser *parser, LydToken *this, LydToken *left)
     return NULL;
   if (strcmp (parser->token->str, ")"))
     {
-      int i;
-      for (i=0; i< LYD_MAX_ARGC; i++)
+      for (;;)
         {
-          this->args[i] = parser_expression (parser, 0);
+          LydToken *arg = parser_expression (parser, 0);
+          if (!arg)
+            break;
+          token_add_arg (parser, this, arg);
           if (strcmp (parser->token->str, ","))
             break;
-          left = parser->token;
           parser_advance (parser, ",");
-          token_free (left);
         }
     }
   parser_advance(parser, ")");
+  if (!parser->error && !strcmp (this->first->str, "global"))
+    {
+      if (this->n_args < 1 || this->n_args > 2 ||
+          this->args[0]->type != literal || !isalpha (this->args[0]->str[0]))
+        parser->error = "expected global(name[, expression])";
+      else if (this->n_args > 1 && (this->args[1]->type == literal ||
+                                    !is_constant_tree (this->args[1])))
+        parser->error = "global modulators need an expression without variables";
+    }
   return this;
 }
 
+/* true if no variables are used in the tree */
+static int is_constant_tree (LydToken *t)
+{
+  int i;
+  switch (t->type)
+    {
+      case variable:
+        return 0;
+      case binary:
+        return is_constant_tree (t->first) && is_constant_tree (t->second);
+      case unary:
+        return is_constant_tree (t->first);
+      case args:
+        for (i = 0; i < t->n_args; i++)
+          if (!is_constant_tree (t->args[i]))
+            return 0;
+        return 1;
+      default:
+        return 1;
+    }
+}
+
 static LydToken *nud_lparen (LydParser *parser, LydToken *this)
 {
   LydToken *e = parser_expression(parser, 0);
   parser_advance (parser, ")");
-  token_free (this);
   return e;
 }
 
@@ -192,27 +377,19 @@ static LydToken *nud_prefix (LydParser *parser, LydToken *this)
   return this;
 }
 
-#define N_ELEMENTS(a)  (sizeof(a)/sizeof(a[0]))
-
 static LydToken *parser_lookup (LydParser *parser,
                                 char   *str)
 {
-  unsigned int i;
-  for (i=0; i<N_ELEMENTS (symbols); i++)
-    {
-      if (!strcmp (symbols[i].str, str))
-        return &symbols[i];
-    }
-  return NULL;
+  LydLexeme *lexeme = lexicon_lookup (str);
+  return lexeme ? lexeme->symbol : NULL;
 }
 
 static LydOpCode str2opcode (Lyd *lyd, const char *str)
 {
-  unsigned int i;
+  LydLexeme *lexeme = lexicon_lookup (str);
   SList *iter;
-  for (i=0 ; i < N_ELEMENTS (op_lexicon); i++)
-    if (!strcmp(str, op_lexicon[i].str))
-      return op_lexicon[i].op;
+  if (lexeme && lexeme->op)
+    return lexeme->op;
 #ifdef LYD_EXTENDABLE
   for (iter = lyd->op_info; iter; iter = iter->next)
     {
@@ -224,17 +401,6 @@ static LydOpCode str2opcode (Lyd *lyd, const char *str)
   return 0;
 }
 
-static float str2constant (const char *str)
-{
-  unsigned int i;
-  for (i=0 ; i < N_ELEMENTS (constant_lexicon); i++)
-    if (!strcmp(str, constant_lexicon[i].str))
-      return constant_lexicon[i].value;
-  return 0.0;
-}
-#define is_op(str)       (str2opcode (lyd, str)!=0)
-#define is_constant(str) (str2constant (str)!=0.0)
-
 static int oneof (char needle, char *haystack)
 {
   char *p;
@@ -246,17 +412,19 @@ static int oneof (char needle, char *haystack)
 
 #define MAX_TOK_LEN 512
 
-static LydToken *parser_scanner_next (LydParser *parser)
+/* scan the next word into word, returning its length, 0 at the end */
+static int parser_scanner_next (LydParser    *parser,
+                                char         *word,
+                                LydTokenType *type)
 {
-  char word[MAX_TOK_LEN]="";
   int   wpos=0;
   int   incomment=0;
   char *whitespace = "\n\r\t ";
   char *numerals   = "0123456789.";
   char *operators  = "+-/*%(),^";
 
-  LydToken *tok = g_new0 (LydToken, 1);
-  
+  *type = name;
+
   /* swallow whitespace */
   while (*parser->p
        && (oneof (*parser->p, whitespace)
@@ -275,25 +443,31 @@ static LydToken *parser_scanner_next (LydParser *parser)
     {
       parser->p++;
       while (*parser->p && *parser->p !='"')
-        word[wpos++]=*parser->p++;
+        if (wpos < MAX_TOK_LEN - 1)
+          word[wpos++]=*parser->p++;
+        else
+          parser->p++;
       if (wpos>=MAX_TOK_LEN)
         wpos=MAX_TOK_LEN-1;
       word[wpos]='\0';
       if (*parser->p=='"')
         parser->p++;
-      tok->type = string;
+      *type = string;
     }
   else if (*parser->p == '\'')
     {
       parser->p++;
       while (*parser->p && *parser->p !='\'')
-        word[wpos++]=*parser->p++;
+        if (wpos < MAX_TOK_LEN - 1)
+          word[wpos++]=*parser->p++;
+        else
+          parser->p++;
       if (wpos>=MAX_TOK_LEN)
         wpos=MAX_TOK_LEN-1;
       word[wpos]='\0';
       if (*parser->p=='\'')
         parser->p++;
-      tok->type = string;
+      *type = string;
     }
   else if (oneof (*parser->p, numerals))
     {
@@ -304,7 +478,7 @@ static LydToken *parser_scanner_next (LydParser *parser)
             wpos=MAX_TOK_LEN-1;
           word[wpos]='\0';
         }
-      tok->type = literal;
+      *type = literal;
     }
   else if (oneof (*parser->p, operators))
     word[wpos++]=*parser->p++;
@@ -321,31 +495,44 @@ static LydToken *parser_scanner_next (LydParser *parser)
                                                 */
             word[wpos++]=*parser->p++;
         }
-      tok->type = name;
+      *type = name;
     }
   word[wpos]=0;
-
-  if (!wpos)
-    {
-      g_free (tok->str);
-      g_free (tok);
-      return NULL;
-    }
-  tok->str = g_strdup (word);
-  return tok;
+  return wpos;
 }
 
-static void token_free (LydToken *token)
+static int
+parser_error_pos (LydParser *parser)
 {
-  if (token->str)
-    g_free (token->str);
-  g_free (token);
+  return parser->p - parser->buf;
 }
 
+/* a string of numbers is a table given inline, 'ratio amplitude ..' for
+ * additive(), it is loaded as a wave named by the string itself */
 static int
-parser_error_pos (LydParser *parser)
+lyd_inline_wave (Lyd *lyd, const char *name)
 {
-  return parser->p - parser->buf;
+  float       data[MAX_TOK_LEN / 2];
+  int         count = 0;
+  const char *p = name;
+
+  for (;;)
+    {
+      char *end;
+      while (*p == ' ' || *p == ',' || *p == '\t' || *p == '\n')
+        p++;
+      if (!*p)
+        break;
+      data[count] = g_ascii_strtod (p, &end);
+      if (end == p)
+        return 0;
+      count++;
+      p = end;
+    }
+  if (!count)
+    return 0;
+  lyd_load_wave (lyd, name, count, lyd->sample_rate, data);
+  return 1;
 }
 
 static int
@@ -359,6 +546,14 @@ lyd_find_wave (Lyd *lyd, const char *name)
         return i;
     }
 
+  if (lyd_inline_wave (lyd, name))
+    for (i = 0; i < LYD_MAX_WAVE; i++)
+      {
+        LydWave *wave = lyd->wave[i];
+        if (wave && !strcmp (wave->name, name))
+          return i;
+      }
+
   if (lyd->wave_handler)
     {
       if (lyd->wave_handler (lyd, name, lyd->wave_handler_data))
@@ -374,15 +569,124 @@ lyd_find_wave (Lyd *lyd, const char *name)
 
   else
     fprintf (stderr, "Failed loading wave data \"%s\" no wave_handler\n", name);
+
+  /* the program being compiled is not kept, it is compiled again once the
+   * wave has been loaded */
+  LOCK ();
+  lyd->compile_version++;
+  UNLOCK ();
   return 0;
 }
 
+/* the entry for key in the names of the parser, a new one with a NULL
+ * symbol the first time key is seen */
+static LydName *parser_name (LydParser *parser, const char *key)
+{
+  unsigned int hash = name_hash (key);
+  unsigned int mask;
+  LydName     *entry;
+
+  if (parser->n_names * 2 >= parser->names_size)
+    {
+      LydName *old = parser->names;
+      int      old_size = parser->names_size;
+      int      i;
+
+      parser->names_size = old_size ? old_size * 2 : 64;
+      parser->names = parser_alloc (parser,
+                                    sizeof (LydName) * parser->names_size);
+      mask = parser->names_size - 1;
+      for (i = 0; i < old_size; i++)
+        if (old[i].key)
+          {
+            unsigned int j = old[i].hash & mask;
+            while (parser->names[j].key)
+              j = (j + 1) & mask;
+            parser->names[j] = old[i];
+          }
+    }
+
+  mask = parser->names_size - 1;
+  for (entry = &parser->names[hash & mask]; entry->key;
+       entry = &parser->names[(entry - parser->names + 1) & mask])
+    if (entry->hash == hash && !strcmp (entry->key, key))
+      return entry;
+  entry->key = parser_strdup (parser, key);
+  entry->str = entry->key;
+  entry->hash = hash;
+  parser->n_names++;
+  return entry;
+}
+
+/* the nop of the variable str, declaring it with value as the default the
+ * first time a variable hashing to the same number is seen */
+static int parser_variable (LydParser *parser, const char *str,
+                            float hashed, const char *value)
+{
+  int j;
+  for (j = 0; j < parser->variables; j++)
+    if (parser->variable[j] == hashed)
+      return j;
+
+  if (parser->variables == parser->variables_size)
+    {
+      parser->variables_size = parser->variables_size * 2 + 8;
+      parser->variable = g_realloc (parser->variable,
+                           sizeof (float) * parser->variables_size);
+      parser->var_default = g_realloc (parser->var_default,
+                           sizeof (float) * parser->variables_size);
+    }
+  parser->var_default[parser->variables] =
+    value ? g_ascii_strtod (value + 1, NULL) : 0.0;
+
+  if (parser->lyd->var_handler)
+    parser->lyd->var_handler (parser->lyd, str,
+                              parser->var_default[parser->variables],
+                              parser->lyd->var_handler_data);
+
+  parser->variable[parser->variables] = hashed;
+  return parser->variables++;
+}
+
+/* work out what a name is read as: one of the primitives, a constant, an
+ * op or else a variable */
+static void parser_resolve (LydParser *parser, LydName *entry)
+{
+  Lyd       *lyd = parser->lyd;
+  LydLexeme *lexeme = NULL;
+  char      *value = strchr (entry->key, '=');
+
+  if (!value)
+    lexeme = lexicon_lookup (entry->key);
+  if (lexeme && lexeme->symbol)
+    entry->symbol = lexeme->symbol;
+  else if (lexeme && lexeme->constant != 0.0)
+    {
+      entry->symbol = parser_lookup (parser, "(lit)");
+      entry->value = lexeme->constant;
+    }
+  else if (!value && str2opcode (lyd, entry->key))
+    entry->symbol = parser_lookup (parser, "(fun)");
+  else
+    {
+      entry->symbol = parser_lookup (parser, "(var)");
+      if (value)
+        {
+          entry->str = parser_strdup (parser, entry->key);
+          entry->str[value - entry->key] = '\0';
+        }
+      entry->value = str2float (entry->str);
+      entry->command_no = parser_variable (parser, entry->str, entry->value,
+                                           value);
+    }
+}
+
 static LydToken *
 parser_advance (LydParser *parser, const char *expected)
 {
-  LydToken *newtok;
-  LydToken *t;
-  Lyd      *lyd = parser->lyd;
+  char          word[MAX_TOK_LEN + 2]; /* the scanner can overshoot by one */
+  LydTokenType  type;
+  LydToken     *newtok;
 
   if (expected && strcmp (parser->token->str, expected))
     {
@@ -391,75 +695,43 @@ parser_advance (LydParser *parser, const char *expected)
       parser->error = msg;
       return NULL;
     }
-  if (!(t = parser_scanner_next (parser)))
+  if (!parser_scanner_next (parser, word, &type))
     {
       return parser_lookup(parser, "(end)");
     }
 
-  newtok = g_malloc0 (sizeof (LydToken));
-  if (t->type == literal)
+  if (parser->global_name == 1 && type == name)
+    { /* the name in global(name ...), not a variable of the voice */
+      newtok = token_new (parser, parser_lookup (parser, "(lit)"),
+                          parser_strdup (parser, word));
+    }
+  else if (type == literal)
     { 
-      *newtok = *parser_lookup (parser, "(lit)");
-      newtok->str = g_strdup (t->str);
-      newtok->value = g_ascii_strtod (t->str, NULL);
+      newtok = token_new (parser, parser_lookup (parser, "(lit)"),
+                          parser_strdup (parser, word));
+      newtok->value = g_ascii_strtod (word, NULL);
     }
-  else if (t->type == string)
+  else if (type == string)
     { 
-      *newtok = *parser_lookup (parser, "(lit)");
-      newtok->str = g_strdup (t->str);
-      newtok->value = lyd_find_wave (parser->lyd, t->str);
+      newtok = token_new (parser, parser_lookup (parser, "(lit)"),
+                          parser_strdup (parser, word));
+      newtok->value = lyd_find_wave (parser->lyd, word);
     }
   else 
     {
-      LydToken *orig;
-      /* check if the token matches one of the primitives */
-      if ((orig = parser_lookup (parser, t->str)))
-        {
-          *newtok = *orig;
-          newtok->str = g_strdup (t->str);
-        }
-      else if (is_constant (t->str)) /* or a constant */
-        {
-          *newtok = *parser_lookup(parser, "(lit)");
-          newtok->str = g_strdup (t->str);
-          newtok->value = str2constant (t->str);
-        }
-      else if (is_op (t->str))
-        {
-          *newtok = *parser_lookup (parser, "(fun)");
-          newtok->str = g_strdup (t->str);
-        }
-      else
-        {
-          int j;
-          char *value;
-          *newtok = *parser_lookup (parser, "(var)");
-          newtok->str = g_strdup (t->str);
-          value = strchr (newtok->str, '=');
-          if (value)
-            {
-              *value = '\0';
-            }
-          newtok->value = str2float (newtok->str);
-          for (j = 0; j < parser->variables; j++)
-            {
-              if (parser->variable[j] == newtok->value)
-                goto found;
-            }
-          if (value)
-            parser->var_default[parser->variables] = g_ascii_strtod (value + 1, NULL);
-
-          if (parser->lyd->var_handler)
-            parser->lyd->var_handler (parser->lyd, newtok->str,
-                                      parser->var_default[parser->variables],
-                                      parser->lyd->var_handler_data);
-
-          parser->variable[parser->variables++] = newtok->value;
-          found:
-          ;
-        }
+      LydName *entry = parser_name (parser, word);
+      if (!entry->symbol)
+        parser_resolve (parser, entry);
+      newtok = token_new (parser, entry->symbol, entry->str);
+      newtok->value = entry->value;
+      newtok->command_no = entry->command_no;
     }
-  token_free (t);
+  if (newtok->type == function && !strcmp (newtok->str, "global"))
+    parser->global_name = 2;
+  else if (parser->global_name == 2 && !strcmp (newtok->str, "("))
+    parser->global_name = 1;
+  else
+    parser->global_name = 0;
   parser->token = newtok;
   return newtok;
 }
@@ -540,9 +812,10 @@ static int tcount (LydParser *parser, LydToken *t, int *cnt)
         t->command_no = *cnt;
 
         (*cnt)++;
-        for (i=0;i< LYD_MAX_ARGC;i++)
-          if (t->args[i])
-            tcount (parser, t->args[i], cnt);
+        if (!strcmp (t->first->str, "global"))
+          break; /* the expression is compiled separately */
+        for (i = 0; i < t->n_args; i++)
+          tcount (parser, t->args[i], cnt);
         break;
       case unary:
         t->command_no = *cnt;
@@ -555,38 +828,19 @@ static int tcount (LydParser *parser, LydToken *t, int *cnt)
   return *cnt;
 }
 
-static void tfree (LydToken *t)
+static void parser_free (LydParser *parser)
 {
-  switch (t->type)
+  int i;
+  for (i = 0; i < parser->n_bake; i++)
+    lyd_bake_free (parser->bake[i]);
+  while (parser->blocks)
     {
-      int i;
-      case binary:
-        tfree (t->first);
-        tfree (t->second);
-        break;
-      case literal:
-      case string:
-      case variable:
-      case function:
-        break;
-      case args:
-        for (i=0;i< LYD_MAX_ARGC;i++)
-          if (t->args[i])
-            tfree (t->args[i]);
-        /* fallthrough */
-      case unary:
-        tfree (t->first);
-        break;
-      default:
-        printf ("%s:%s!!!%i %s`\n", __FILE__, __FUNCTION__, t->type, t->str);
+      LydParserBlock *block = parser->blocks;
+      parser->blocks = block->next;
+      g_free (block);
     }
-  token_free (t);
-}
-
-static void parser_free (LydParser *parser)
-{
-  if (parser->tree)
-    tfree (parser->tree);
+  g_free (parser->variable);
+  g_free (parser->var_default);
   g_free (parser);
 }
 
@@ -614,8 +868,8 @@ static void sexp (LydToken *t)
         break;
       case args:
         printf ("(%s", t->first->str);
-        for (i=0;i< LYD_MAX_ARGC;i++)
-          if (t->args[i]) sexp (t->args[i]);
+        for (i = 0; i < t->n_args; i++)
+          sexp (t->args[i]);
         printf (")");
         break;
       case unary:
@@ -626,6 +880,504 @@ static void sexp (LydToken *t)
     }
 }
 
+/* Baking of periodic subexpressions: sums, products and other plain math
+ * on constants and oscillators whose frequencies are constant multiples of
+ * the same expression are a function of the phase of that frequency only.
+ * One cycle is sampled here and the expression replaced by baked(frequency,
+ * index) playing band limited tables made from it, see bake.c. Expressions
+ * using variables are left alone, so that no table is made while rendering.
+ */
+
+static int is_oscillator (const char *str)
+{
+  static const char *oscillators[] = {"sin", "saw", "ramp", "square",
+    "triangle", "abssin", "possin", "pulssin", "evensin", "evenpossin"};
+  unsigned int i;
+  for (i = 0; i < N_ELEMENTS (oscillators); i++)
+    if (!strcmp (str, oscillators[i]))
+      return 1;
+  return 0;
+}
+
+/* math without state that bake_eval knows */
+static int is_pure (LydToken *t)
+{
+  static const char *pure[] = {"+", "-", "*", "/", "^", "%", "min", "max",
+    "abs", "neg", "rcp", "sqrt", "mix", "sum"};
+  const char  *str = t->type == args ? t->first->str : t->str;
+  unsigned int i;
+  if (t->type == unary)
+    return 1;
+  for (i = 0; i < N_ELEMENTS (pure); i++)
+    if (!strcmp (str, pure[i]))
+      return 1;
+  return 0;
+}
+
+static int tree_equal (LydToken *a, LydToken *b)
+{
+  int i;
+  if (a->type != b->type)
+    return 0;
+  switch (a->type)
+    {
+      case binary:
+        return !strcmp (a->str, b->str) &&
+               tree_equal (a->first, b->first) &&
+               tree_equal (a->second, b->second);
+      case unary:
+        return tree_equal (a->first, b->first);
+      case args:
+        if (strcmp (a->first->str, b->first->str))
+          return 0;
+        if (a->n_args != b->n_args)
+          return 0;
+        for (i = 0; i < a->n_args; i++)
+          if (!tree_equal (a->args[i], b->args[i]))
+            return 0;
+        return 1;
+      default:
+        return a->value == b->value && !strcmp (a->str, b->str);
+    }
+}
+
+/* true if t calls one of the functions that give different values each
+ * time they are used, or an oscillator when oscillators is set */
+static int tree_uses (LydToken *t, int oscillators)
+{
+  int i;
+  switch (t->type)
+    {
+      case binary:
+        return tree_uses (t->first, oscillators) ||
+               tree_uses (t->second, oscillators);
+      case unary:
+        return tree_uses (t->first, oscillators);
+      case args:
+        if (oscillators ? is_oscillator (t->first->str)
+                        : (!strcmp (t->first->str, "noise") ||
+                           !strcmp (t->first->str, "pluck") ||
+                           !strcmp (t->first->str, "pluck_unison") ||
+                           !strcmp (t->first->str, "grains") ||
+                           !strcmp (t->first->str, "input")))
+          return 1;
+        for (i = 0; i < t->n_args; i++)
+          if (tree_uses (t->args[i], oscillators))
+            return 1;
+        return 0;
+      default:
+        return 0;
+    }
+}
+
+/* split the frequency of an oscillator into the expression it shares with
+ * others and a ratio */
+static LydToken *bake_base (LydToken *freq, float *ratio)
+{
+  *ratio = 1.0;
+  if (freq->type == binary && !strcmp (freq->str, "*"))
+    {
+      if (freq->second->type == literal)
+        {
+          *ratio = freq->second->value;
+          return freq->first;
+        }
+      if (freq->first->type == literal)
+        {
+          *ratio = freq->first->value;
+          return freq->second;
+        }
+    }
+  return freq;
+}
+
+/* whether t only combines constants and oscillators of base with pure
+ * math, counting the oscillators and the lowest ratio among them */
+static int bake_periodic (LydToken  *t,
+                          LydToken **base,
+                          int       *oscillators,
+                          float     *lowest)
+{
+  int i;
+
+  if (t->type == literal)
+    return 1;
+  if (t->type == args && is_oscillator (t->first->str))
+    {
+      float     ratio;
+      LydToken *freq;
+      if (t->n_args != 1)
+        return 0;
+      freq = bake_base (t->args[0], &ratio);
+      if (ratio <= 0.0 || tree_uses (freq, 0) ||
+          (*base && !tree_equal (*base, freq)))
+        return 0;
+      *base = freq;
+      if (!(*oscillators)++ || ratio < *lowest)
+        *lowest = ratio;
+      return 1;
+    }
+  if (!is_pure (t))
+    return 0;
+  if (t->type == args)
+    {
+      for (i = 0; i < t->n_args; i++)
+        if (!bake_periodic (t->args[i], base, oscillators, lowest))
+          return 0;
+      return 1;
+    }
+  return bake_periodic (t->first, base, oscillators, lowest) &&
+         (t->type == unary ||
+          bake_periodic (t->second, base, oscillators, lowest));
+}
+
+/* whether the oscillators of t are low harmonics of fundamental */
+static int bake_harmonic (LydToken *t, float fundamental)
+{
+  int i;
+  switch (t->type)
+    {
+      case binary:
+        return bake_harmonic (t->first, fundamental) &&
+               bake_harmonic (t->second, fundamental);
+      case unary:
+        return bake_harmonic (t->first, fundamental);
+      case args:
+        if (is_oscillator (t->first->str))
+          {
+            float harmonic;
+            bake_base (t->args[0], &harmonic);
+            harmonic /= fundamental;
+            return harmonic < 64.5 &&
+                   fabsf (harmonic - (int)(harmonic + 0.5)) <= 0.001;
+          }
+        for (i = 0; i < t->n_args; i++)
+          if (!bake_harmonic (t->args[i], fundamental))
+            return 0;
+        return 1;
+      default:
+        return 1;
+    }
+}
+
+/* the value of t at phase of the cycle of fundamental */
+static float bake_eval (LydParser *parser,
+                        LydToken  *t,
+                        float      phase,
+                        float      fundamental)
+{
+  const char *str = t->type == args ? t->first->str : t->str;
+  float       a, b;
+  int         i;
+
+  switch (t->type)
+    {
+      case literal:
+        return t->value;
+      case unary:
+        return -bake_eval (parser, t->first, phase, fundamental);
+      case binary:
+        a = bake_eval (parser, t->first, phase, fundamental);
+        b = bake_eval (parser, t->second, phase, fundamental);
+        switch (str[0])
+          {
+            case '+': return a + b;
+            case '-': return a - b;
+            case '*': return a * b;
+            case '/': return b != 0.0 ? a / b : 0.0;
+            case '^': return powf (a, b);
+            default:  return fmodf (a, b);
+          }
+      default:
+        break;
+    }
+  if (is_oscillator (str))
+    {
+      float ratio;
+      int   harmonic;
+      bake_base (t->args[0], &ratio);
+      harmonic = ratio / fundamental + 0.5;
+      phase *= harmonic;
+      return lyd_bake_oscillator (str2opcode (parser->lyd, str),
+                                  phase - (int)phase);
+    }
+  if (!strcmp (str, "sum") || !strcmp (str, "mix"))
+    {
+      for (a = 0.0, i = 0; i < t->n_args; i++)
+        a += bake_eval (parser, t->args[i], phase, fundamental);
+      return t->n_args && str[0] == 'm' ? a / t->n_args : a;
+    }
+  a = t->n_args > 0 ? bake_eval (parser, t->args[0], phase, fundamental) : 0;
+  b = t->n_args > 1 ? bake_eval (parser, t->args[1], phase, fundamental) : 0;
+  if (!strcmp (str, "min"))  return a > b ? b : a;
+  if (!strcmp (str, "max"))  return a < b ? b : a;
+  if (!strcmp (str, "abs"))  return fabsf (a);
+  if (!strcmp (str, "neg"))  return -a;
+  if (!strcmp (str, "rcp"))  return 1.0 / a;
+  return sqrtf (a);
+}
+
+/* tokens for the compiler to insert into trees */
+static LydToken *literal_new (LydParser *parser, float value)
+{
+  LydToken *t = token_new (parser, parser_lookup (parser, "(lit)"), "0");
+  t->value = value;
+  return t;
+}
+
+static LydToken *call_new (LydParser *parser, const char *function,
+                           int n_args)
+{
+  LydToken *t = token_new (parser, parser_lookup (parser, "("), "(");
+  t->type = args;
+  t->first = token_new (parser, parser_lookup (parser, "(fun)"), function);
+  t->args = n_args ? parser_alloc (parser, sizeof (LydToken *) * n_args)
+                   : NULL;
+  t->n_args = t->args_size = n_args;
+  return t;
+}
+
+/* replace the periodic expression at *link with baked() */
+static int bake_replace (LydParser *parser,
+                         LydToken **link,
+                         LydToken  *base,
+                         float      lowest)
+{
+  const int  n = LYD_BAKE_SIZE * LYD_BAKE_OVERSAMPLE;
+  LydToken  *t = *link;
+  LydToken  *baked;
+  float     *cycle;
+  float      fundamental = 0.0;
+  int        divisor, i;
+
+  if (parser->n_bake >= LYD_MAX_BAKED)
+    return 0;
+  for (divisor = 1; divisor <= 16 && !fundamental; divisor++)
+    if (bake_harmonic (t, lowest / divisor))
+      fundamental = lowest / divisor;
+  if (!fundamental)
+    return 0;
+
+  cycle = g_malloc (sizeof (float) * n);
+  for (i = 0; i < n; i++)
+    cycle[i] = bake_eval (parser, t, (float)i / n, fundamental);
+  parser->bake[parser->n_bake] = lyd_bake_new (cycle, fundamental);
+  g_free (cycle);
+
+  baked = call_new (parser, "baked", 2);
+  baked->args[0] = base; /* the rest of t is dropped */
+  baked->args[1] = literal_new (parser, parser->n_bake++);
+  *link = baked;
+  return 1;
+}
+
+static void bake_tree (LydParser *parser, LydToken **link)
+{
+  LydToken *t = *link;
+  LydToken *base = NULL;
+  int       oscillators = 0;
+  float     lowest = 0.0;
+  int       i;
+
+  if (t->type == args && !strcmp (t->first->str, "global"))
+    return; /* the expression is compiled separately */
+
+  if (bake_periodic (t, &base, &oscillators, &lowest) && oscillators > 1 &&
+      bake_replace (parser, link, base, lowest))
+    return;
+
+  switch (t->type)
+    {
+      case binary:
+        bake_tree (parser, &t->first);
+        bake_tree (parser, &t->second);
+        break;
+      case unary:
+        bake_tree (parser, &t->first);
+        break;
+      case args:
+        for (i = 0; i < t->n_args; i++)
+          bake_tree (parser, &t->args[i]);
+        break;
+      default:
+        break;
+    }
+}
+
+/* a number, possibly negated */
+static int literal_number (LydToken *t, float *value)
+{
+  if (t->type == literal && (isdigit (t->str[0]) || t->str[0] == '.'))
+    {
+      *value = t->value;
+      return 1;
+    }
+  if (t->type == unary && literal_number (t->first, value))
+    {
+      *value = -*value;
+      return 1;
+    }
+  return 0;
+}
+
+/* replace ^, / and % by a constant with cheaper ops: powers that are a
+ * few multiplications, a reciprocal or a square root become powi(),
+ * division a multiplication by the reciprocal and modulus wrap() */
+static void reduce_tree (LydParser *parser, LydToken **link)
+{
+  LydToken *t = *link;
+  LydToken *call;
+  float     value;
+  int       i;
+
+  switch (t->type)
+    {
+      case binary:
+        reduce_tree (parser, &t->first);
+        reduce_tree (parser, &t->second);
+        break;
+      case unary:
+        reduce_tree (parser, &t->first);
+        return;
+      case args:
+        if (!strcmp (t->first->str, "global"))
+          return; /* the expression is compiled separately */
+        for (i = 0; i < t->n_args; i++)
+          reduce_tree (parser, &t->args[i]);
+        return;
+      default:
+        return;
+    }
+
+  if (!literal_number (t->second, &value))
+    return;
+  switch (t->str[0])
+    {
+      case '/':
+        if (value == 0.0)
+          return;
+        t->str = "*";
+        t->second = literal_new (parser, 1.0 / value);
+        return;
+      case '^':
+        if (value != 2.0 && value != 3.0 && value != 4.0 &&
+            value != -1.0 && value != -2.0 && value != 0.5)
+          return;
+        call = call_new (parser, "powi", 2);
+        break;
+      case '%':
+        if (value == 0.0)
+          return;
+        call = call_new (parser, "wrap", 2);
+        break;
+      default:
+        return;
+    }
+  call->args[0] = t->first;
+  call->args[1] = literal_new (parser, value);
+  *link = call;
+}
+
+static int is_call (LydToken *t, const char *function)
+{
+  return t->type == args && !strcmp (t->first->str, function);
+}
+
+static int is_sum (LydToken *t)
+{
+  return (t->type == binary && !strcmp (t->str, "+")) || is_call (t, "sum");
+}
+
+static int sum_count (LydToken *t)
+{
+  int i, n = 0;
+  if (t->type == binary && is_sum (t))
+    return sum_count (t->first) + sum_count (t->second);
+  if (!is_sum (t))
+    return 1;
+  for (i = 0; i < t->n_args; i++)
+    n += sum_count (t->args[i]);
+  return n;
+}
+
+/* move the terms of the sum t to the arguments of call */
+static void sum_terms (LydParser *parser, LydToken *call, LydToken *t)
+{
+  int i;
+  if (!is_sum (t))
+    {
+      token_add_arg (parser, call, t);
+      return;
+    }
+  if (t->type == binary)
+    {
+      sum_terms (parser, call, t->first);
+      sum_terms (parser, call, t->second);
+    }
+  else
+    for (i = 0; i < t->n_args; i++)
+      sum_terms (parser, call, t->args[i]);
+}
+
+/* turn chains of + into one sum() and mixes of equally sized mixes into
+ * one mix, these ops take any number of inputs and add them in one pass
+ * instead of a chunk per addition */
+static void flatten_tree (LydParser *parser, LydToken **link)
+{
+  LydToken *t = *link;
+  LydToken *call;
+  int       i, j;
+
+  switch (t->type)
+    {
+      case binary:
+        flatten_tree (parser, &t->first);
+        flatten_tree (parser, &t->second);
+        break;
+      case unary:
+        flatten_tree (parser, &t->first);
+        return;
+      case args:
+        if (is_call (t, "global"))
+          return; /* the expression is compiled separately */
+        for (i = 0; i < t->n_args; i++)
+          flatten_tree (parser, &t->args[i]);
+        break;
+      default:
+        return;
+    }
+
+  if (is_sum (t) && (t->type == binary ? sum_count (t) > 2
+                                       : sum_count (t) > t->n_args))
+    {
+      call = call_new (parser, "sum", 0);
+      sum_terms (parser, call, t);
+      *link = call;
+      return;
+    }
+
+  /* mix (mix (a, b), mix (c, d)) is mix (a, b, c, d) */
+  if (is_call (t, "mix") && t->n_args)
+    {
+      for (i = 0; i < t->n_args; i++)
+        if (!is_call (t->args[i], "mix") ||
+            t->args[i]->n_args != t->args[0]->n_args)
+          return;
+      call = call_new (parser, "mix", 0);
+      for (i = 0; i < t->n_args; i++)
+        {
+          LydToken *inner = t->args[i];
+          for (j = 0; j < inner->n_args; j++)
+            token_add_arg (parser, call, inner->args[j]);
+        }
+      *link = call;
+    }
+}
+
+static LydProgram *compile_program (LydParser *parser,
+                                    LydToken  *tree,
+                                    int        variables);
+
 static void compile (LydParser  *parser,
                      LydToken   *t,
                      LydProgram *program,
@@ -661,14 +1413,8 @@ static void compile (LydParser  *parser,
       case literal:
         program->commands[command].arg[argno] = t->value;
         break;
-      case variable:
-        {
-          int j;
-          for (j = 0; j < parser->variables; j++)
-            if (parser->variable[j]==t->value)
-              break;
-          program->commands[command].arg[argno] = j - command;
-        }
+      case variable: /* the nop of the variable */
+        program->commands[command].arg[argno] = t->command_no - command;
         break;
       case args:
         {
@@ -682,12 +1428,25 @@ static void compile (LydParser  *parser,
 
           /* set the type of the function oursevles */
           program->commands[POS(t)].op = str2opcode (lyd, t->first->str);
-          for (i=0;i< LYD_MAX_ARGC;i++)
-            if (t->args[i])
-              {
-                program->commands[POS(t)].argc++;
-                compile (parser, t->args[i], program, totcmds, POS(t), i);
-              }
+          if (program->commands[POS(t)].op == LYD_GLOBAL)
+            { /* reads a modulator shared by all voices, declaring it
+                 first when an expression is given */
+              LydProgram *modulator = NULL;
+              int         no;
+              if (t->n_args > 1)
+                modulator = compile_program (parser, t->args[1], 0);
+              no = lyd_global_declare (lyd, t->args[0]->str, modulator, 0);
+              if (modulator)
+                lyd_program_free (modulator);
+              program->commands[POS(t)].argc = 1;
+              program->commands[POS(t)].arg[0] = no < 0 ? LYD_MAX_GLOBALS : no;
+              break;
+            }
+          for (i = 0; i < t->n_args; i++)
+            {
+              program->commands[POS(t)].argc++;
+              compile (parser, t->args[i], program, totcmds, POS(t), i);
+            }
         }
         break;
       case unary: 
@@ -726,19 +1485,96 @@ static void print_program (LydProgram *program)
   printf ("},\n");
 }
 
-void
-lyd_program_free (LydProgram *program)
+/* the arguments a command needs room for, the ones the op reads or the
+ * ones it was passed */
+static int command_slots (LydParser *parser, LydOpCode op, int argc)
 {
-  g_free (program);
+  int slots = lyd_op_argc (parser->lyd, op);
+  return slots > argc ? slots : argc;
 }
 
-LydProgram *lyd_compile (Lyd *lyd, const char *source)
+/* count the argument slots of the commands of t, pointing the commands at
+ * their part of program->args when program is given */
+static void targs (LydParser  *parser,
+                   LydToken   *t,
+                   LydProgram *program,
+                   int         totcmds,
+                   int        *used)
+{
+  int i;
+
+  if (program && (t->type == binary || t->type == unary || t->type == args))
+    program->commands[totcmds - 1 - t->command_no].arg = program->args + *used;
+  switch (t->type)
+    {
+      case binary:
+        *used += command_slots (parser, str2opcode (parser->lyd, t->str), 2);
+        targs (parser, t->first, program, totcmds, used);
+        targs (parser, t->second, program, totcmds, used);
+        break;
+      case unary:
+        *used += command_slots (parser, LYD_NEG, 1);
+        targs (parser, t->first, program, totcmds, used);
+        break;
+      case args:
+        *used += command_slots (parser, str2opcode (parser->lyd, t->first->str),
+                                t->n_args);
+        if (!strcmp (t->first->str, "global"))
+          break; /* the expression is compiled separately */
+        for (i = 0; i < t->n_args; i++)
+          targs (parser, t->args[i], program, totcmds, used);
+        break;
+      default:
+        break;
+    }
+}
+
+/* build the commands for tree, preceded by the nops holding the first
+ * variables of the parser */
+static LydProgram *compile_program (LydParser *parser,
+                                    LydToken  *tree,
+                                    int        variables)
+{
+  Lyd        *lyd = parser->lyd;
+  LydProgram *program;
+  int         commands;
+  int         nop_slots = command_slots (parser, LYD_NOP, 2);
+  int         slots;
+  int         i;
+
+  /* the program is allocated with its commands, terminated by a 0 op,
+   * followed by their arguments */
+  commands = tcount (parser, tree, NULL) + variables;
+  slots = variables * nop_slots;
+  targs (parser, tree, NULL, commands, &slots);
+  program = g_malloc0 (sizeof (LydProgram) + sizeof (LydOp) * (commands + 1) +
+                       sizeof (float) * slots);
+  program->ref_count = 1;
+  pthread_mutex_init (&program->mutex, NULL);
+  program->commands = (LydOp *)(program + 1);
+  program->args = (float *)(program->commands + commands + 1);
+
+  for (i = 0; i < variables; i++)
+    program->commands[i].arg = program->args + i * nop_slots;
+  slots = variables * nop_slots;
+  targs (parser, tree, program, commands, &slots);
+
+  if (commands > 0)
+    compile (parser, tree, program, commands, commands - 1, 0);
+  for (i=0; i<variables; i++)
+    {
+      program->commands[i].op = str2opcode (lyd, "nop");
+      program->commands[i].arg[0] = parser->var_default[i];
+      program->commands[i].arg[1] = parser->variable[i];
+    }
+  return program;
+}
+
+static LydProgram *compile_source (Lyd *lyd, const char *source)
 {
   LydParser *parser = parser_new (lyd, source);
   LydProgram *program;
-  int commands;
   LydToken *t;
-  int i;
 
   t = parser_parse (parser);
   if (!t)
@@ -750,16 +1586,13 @@ LydProgram *lyd_compile (Lyd *lyd, const char *source)
         
       return NULL;
     }
-  program = g_new0 (LydProgram, 1);
-  commands = tcount (parser, parser->tree, NULL);
-  compile (parser, parser->tree, program, commands + parser->variables,
-           commands+parser->variables-1, 0);
-  for (i=0; i<parser->variables; i++)
-    {
-      program->commands[i].op = str2opcode (lyd, "nop");
-      program->commands[i].arg[0] = parser->var_default[i];
-      program->commands[i].arg[1] = parser->variable[i];
-    }
+  bake_tree (parser, &parser->tree);
+  flatten_tree (parser, &parser->tree);
+  reduce_tree (parser, &parser->tree);
+  program = compile_program (parser, parser->tree, parser->variables);
+  memcpy (program->bake, parser->bake, sizeof (LydBake*) * parser->n_bake);
+  program->n_bake = parser->n_bake;
+  parser->n_bake = 0;
 
   if (0)
     {
@@ -771,3 +1604,194 @@ LydProgram *lyd_compile (Lyd *lyd, const char *source)
   parser_free (parser);
   return program;
 }
+
+/* Compiled programs are kept by lyd, keyed by the words of their source
+ * as the scanner sees them, so spacing, comments and quoting do not
+ * matter, and by the compile_version they were compiled for. */
+struct _LydCompiled
+{
+  LydCompiled  *next;     /* in the bucket */
+  LydCompiled  *newer;    /* LRU order */
+  LydCompiled  *older;
+  unsigned int  hash;
+  int           version;
+  LydProgram   *program;  /* holds a reference */
+  char         *key;      /* type and word of each lexeme, 0 terminated,
+                             allocated after the LydCompiled */
+  int           length;
+};
+
+/* the scanned words of source, hashed */
+static char *source_key (const char *source, int *length, unsigned int *hash)
+{
+  LydParser     parser = {0};
+  char          word[MAX_TOK_LEN + 2];
+  LydTokenType  type;
+  char         *key = NULL;
+  int           size = 0;
+  int           len;
+
+  parser.buf = parser.p = source;
+  *length = 0;
+  *hash = 2166136261u;
+  while ((len = parser_scanner_next (&parser, word, &type)))
+    {
+      int i;
+      if (*length + len + 2 > size)
+        {
+          size = (*length + len + 2) * 2;
+          key = g_realloc (key, size);
+        }
+      key[(*length)++] = 'a' + type;
+      memcpy (key + *length, word, len + 1);
+      *length += len + 1;
+      for (i = *length - len - 2; i < *length; i++)
+        *hash = (*hash ^ (unsigned char)key[i]) * 16777619u;
+    }
+  return key;
+}
+
+static void compiled_unlink (Lyd *lyd, LydCompiled *compiled)
+{
+  LydCompiled **link =
+    &lyd->program_bucket[compiled->hash & (LYD_PROGRAM_BUCKETS - 1)];
+  while (*link != compiled)
+    link = &(*link)->next;
+  *link = compiled->next;
+
+  if (compiled->newer)
+    compiled->newer->older = compiled->older;
+  else
+    lyd->program_newest = compiled->older;
+  if (compiled->older)
+    compiled->older->newer = compiled->newer;
+  else
+    lyd->program_oldest = compiled->newer;
+  lyd->programs_cached--;
+}
+
+static void compiled_make_newest (Lyd *lyd, LydCompiled *compiled)
+{
+  if (lyd->program_newest == compiled)
+    return;
+  if (compiled->newer)
+    compiled->newer->older = compiled->older;
+  if (compiled->older)
+    compiled->older->newer = compiled->newer;
+  else if (lyd->program_oldest == compiled)
+    lyd->program_oldest = compiled->newer;
+
+  compiled->older = lyd->program_newest;
+  compiled->newer = NULL;
+  if (lyd->program_newest)
+    lyd->program_newest->newer = compiled;
+  lyd->program_newest = compiled;
+  if (!lyd->program_oldest)
+    lyd->program_oldest = compiled;
+}
+
+static void compiled_free (LydCompiled *compiled)
+{
+  lyd_program_unref (compiled->program);
+  g_free (compiled);
+}
+
+static LydCompiled *compiled_find (Lyd          *lyd,
+                                   const char   *key,
+                                   int           length,
+                                   unsigned int  hash)
+{
+  LydCompiled *compiled;
+  for (compiled = lyd->program_bucket[hash & (LYD_PROGRAM_BUCKETS - 1)];
+       compiled; compiled = compiled->next)
+    if (compiled->hash == hash && compiled->length == length &&
+        !memcmp (compiled->key, key, length))
+      return compiled;
+  return NULL;
+}
+
+LydProgram *lyd_compile (Lyd *lyd, const char *source)
+{
+  LydCompiled  *compiled, *dropped[2] = {NULL, NULL};
+  LydProgram   *program;
+  char         *key;
+  int           length, version, i;
+  unsigned int  hash;
+
+  /* the handler is told about the variables of every compile */
+  if (lyd->var_handler)
+    return compile_source (lyd, source);
+
+  key = source_key (source, &length, &hash);
+  pthread_mutex_lock (&lyd->cmutex);
+  version = lyd->compile_version;
+  compiled = compiled_find (lyd, key, length, hash);
+  if (compiled && compiled->version == version)
+    {
+      program = compiled->program;
+      compiled_make_newest (lyd, compiled);
+      pthread_mutex_lock (&program->mutex);
+      program->ref_count++;
+      pthread_mutex_unlock (&program->mutex);
+      pthread_mutex_unlock (&lyd->cmutex);
+      g_free (key);
+      return program;
+    }
+  pthread_mutex_unlock (&lyd->cmutex);
+
+  program = compile_source (lyd, source);
+  if (!program)
+    {
+      g_free (key);
+      return NULL;
+    }
+
+  compiled = g_malloc (sizeof (LydCompiled) + length);
+  compiled->hash = hash;
+  compiled->version = version;
+  compiled->program = program;
+  compiled->key = (char *)(compiled + 1);
+  compiled->length = length;
+  memcpy (compiled->key, key, length);
+  g_free (key);
+  program->ref_count++; /* not yet shared, no need to lock */
+
+  /* replace an entry for an older version, or one another thread added
+   * meanwhile, and make room */
+  pthread_mutex_lock (&lyd->cmutex);
+  if ((dropped[0] = compiled_find (lyd, compiled->key, length, hash)))
+    compiled_unlink (lyd, dropped[0]);
+  if (lyd->programs_cached >= LYD_PROGRAM_CACHE)
+    compiled_unlink (lyd, dropped[1] = lyd->program_oldest);
+  compiled->next = lyd->program_bucket[hash & (LYD_PROGRAM_BUCKETS - 1)];
+  lyd->program_bucket[hash & (LYD_PROGRAM_BUCKETS - 1)] = compiled;
+  compiled->newer = compiled->older = NULL;
+  compiled_make_newest (lyd, compiled);
+  lyd->programs_cached++;
+  pthread_mutex_unlock (&lyd->cmutex);
+
+  /* program_unref takes other locks */
+  for (i = 0; i < 2; i++)
+    if (dropped[i])
+      compiled_free (dropped[i]);
+  return program;
+}
+
+void lyd_program_cache_flush (Lyd *lyd)
+{
+  LydCompiled *compiled;
+
+  pthread_mutex_lock (&lyd->cmutex);
+  compiled = lyd->program_oldest;
+  memset (lyd->program_bucket, 0, sizeof (lyd->program_bucket));
+  lyd->program_newest = lyd->program_oldest = NULL;
+  lyd->programs_cached = 0;
+  pthread_mutex_unlock (&lyd->cmutex);
+
+  while (compiled)
+    {
+      LydCompiled *next = compiled->newer;
+      compiled_free (compiled);
+      compiled = next;
+    }
+}
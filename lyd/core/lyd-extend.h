@@ -47,9 +47,11 @@ struct _LydOpState
 #ifdef LYD_EXTENDABLE
   LydOpInfo  *info;
 #endif
-  LydSample  *arg[LYD_MAX_ARGC]; /* points either to own literals, or other op
-                                    outputs */
-  LydSample  *literal[LYD_MAX_ARGC];
+  int         slots;  /* length of arg and literal, at least LYD_MAX_ARGC,
+                         ops with any number of arguments get argc */
+  LydSample **arg;    /* points either to own literals, or other op
+                         outputs */
+  LydSample **literal;
 };
 
 /**
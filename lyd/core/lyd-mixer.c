@@ -20,20 +20,33 @@
 #include <math.h>
 #include <assert.h>
 #include <unistd.h>
+#include <stdint.h>
 #include "core/lyd-private.h"
 
 /* we include the voice directly to make the mixing and the vm 
  * a single compilation unit
  */
 
-static void   lyd_prepare_buffer (Lyd *lyd, int samples);
+static void   lyd_prepare_buffer (Lyd *lyd, int samples, int pipelined,
+                                  void *stream, void *stream2);
+static void   lyd_prepare_buses (Lyd *lyd, int samples, int pipelined);
 static void   lyd_pre_cb (Lyd *lyd, int samples);
+static void   lyd_process_globals (Lyd *lyd, int samples);
 static SList *lyd_queue_voices (Lyd *lyd, int samples);
 static void   lyd_thread_render_voices (Lyd *lyd, int samples, int thread_no);
 static void   lyd_collapse_threads (Lyd *lyd, int samples);
-static void   lyd_apply_global_filter (Lyd *lyd, int samples);
-static void   lyd_scale_volume (Lyd *lyd, int samples);
-static void   lyd_write_to_output (Lyd *lyd, int samples,
+static void   lyd_master_stage (Lyd *lyd, int samples, LydSample **mix,
+                                int pending, void *stream, void *stream2);
+static void   lyd_master_start (Lyd *lyd, int samples,
+                                void *stream, void *stream2);
+static void   lyd_master_wait (Lyd *lyd);
+static void   lyd_pipeline_swap (Lyd *lyd, int samples);
+static void   lyd_process_buses (Lyd *lyd, int samples, LydSample **mix,
+                                 int pending);
+static void   lyd_apply_global_filter (Lyd *lyd, int samples,
+                                       LydSample **mix, int pending);
+static void   lyd_scale_volume (Lyd *lyd, int samples, LydSample **mix);
+static void   lyd_write_to_output (Lyd *lyd, int samples, LydSample **mix,
                                    void *stream, void *stream2);
 static void   lyd_kill_silent_voices (Lyd *lyd, SList *active);
 static void   lyd_kill_excessive_voices (Lyd *lyd, SList *active);
@@ -56,6 +69,8 @@ lyd_synthesize (Lyd  *lyd,
                 void *stream2)
 {
   SList *active = NULL;
+  int pipelined = lyd->pipelined;
+  int primed;
   int i;
 
   /* we do this here to ensure that the locking is done by the right thread */
@@ -63,13 +78,21 @@ lyd_synthesize (Lyd  *lyd,
   lyd_worker_threads_init (lyd);
 #endif
 
-  lyd_prepare_buffer (lyd, samples);
+  lyd_prepare_buffer (lyd, samples, pipelined, stream, stream2);
   lyd_pre_cb (lyd, samples);
 
   LOCK ();
 
+  lyd_prepare_buses (lyd, samples, pipelined);
+  lyd_process_globals (lyd, samples);
   active = lyd_queue_voices (lyd, samples);
 
+  /* when pipelined the previous period goes through the master stage while
+   * this one is rendered */
+  primed = pipelined && lyd->pipe_samples == samples;
+  if (primed)
+    lyd_master_start (lyd, samples, stream, stream2);
+
 #ifndef LYD_THREADED
   lyd_thread_render_voices (lyd, samples, 0);
 #else
@@ -93,11 +116,25 @@ lyd_synthesize (Lyd  *lyd,
   lyd_collapse_threads (lyd, samples);
 #endif
 
-  lyd_apply_global_filter (lyd, samples);
-
-  lyd_scale_volume (lyd, samples);
+  if (!pipelined)
+    lyd_master_stage (lyd, samples, lyd->mix, 0, stream, stream2);
+  else
+    {
+      if (primed)
+        lyd_master_wait (lyd);
+      else /* nothing rendered yet for this period size */
+        {
+          LydSample *silence[LYD_MAX_CHANNELS];
+          for (i = 0; i < lyd->channels; i++)
+            {
+              silence[i] = lyd->pipe_buf + i * samples;
+              memset (silence[i], 0, sizeof (LydSample) * samples);
+            }
+          lyd_write_to_output (lyd, samples, silence, stream, stream2);
+        }
+      lyd_pipeline_swap (lyd, samples);
+    }
 
-  lyd_write_to_output (lyd, samples, stream, stream2);
   lyd_kill_silent_voices (lyd, active);
   lyd_kill_excessive_voices (lyd, active);
 
@@ -141,18 +178,88 @@ static int lyd_get_num_cores (void)
   return sysconf (_SC_NPROCESSORS_ONLN);
 }
 
+static void *master_thread (void *aux)
+{
+  Lyd *lyd = aux;
+
+  for (;;)
+    {
+      LydSample *mix[LYD_MAX_CHANNELS];
+      int c;
+      pthread_mutex_lock (&lyd->master_mutex);
+
+      while (!lyd->master_pending && !lyd->master_stop)
+        pthread_cond_wait (&lyd->master_cond, &lyd->master_mutex);
+      if (!lyd->master_pending) /* stopping, with no period left over */
+        {
+          pthread_mutex_unlock (&lyd->master_mutex);
+          break;
+        }
+
+      for (c = 0; c < lyd->channels; c++)
+        mix[c] = lyd->pipe_buf + c * lyd->master_samples;
+      lyd_master_stage (lyd, lyd->master_samples, mix, 1,
+                        lyd->master_stream[0], lyd->master_stream[1]);
+      lyd->master_pending = 0;
+      pthread_mutex_unlock (&lyd->master_mutex);
+      pthread_cond_signal (&lyd->master_cond);
+    }
+  return NULL;
+}
+
+/* hands the pending period to the master thread, started on first use */
+static void lyd_master_start (Lyd *lyd, int samples,
+                              void *stream, void *stream2)
+{
+  if (!lyd->master_started)
+    {
+      pthread_mutex_init (&lyd->master_mutex, NULL);
+      pthread_cond_init (&lyd->master_cond, NULL);
+      pthread_create (&lyd->master_tid, NULL, master_thread, lyd);
+      lyd->master_started = 1;
+    }
+  pthread_mutex_lock (&lyd->master_mutex);
+  lyd->master_samples = samples;
+  lyd->master_stream[0] = stream;
+  lyd->master_stream[1] = stream2;
+  lyd->master_pending = 1;
+  pthread_mutex_unlock (&lyd->master_mutex);
+  pthread_cond_signal (&lyd->master_cond);
+}
+
+static void lyd_master_wait (Lyd *lyd)
+{
+  pthread_mutex_lock (&lyd->master_mutex);
+  while (lyd->master_pending)
+    pthread_cond_wait (&lyd->master_cond, &lyd->master_mutex);
+  pthread_mutex_unlock (&lyd->master_mutex);
+}
+
+/* finishes a pending period and ends the master thread, for lyd_free */
+void lyd_master_stop (Lyd *lyd)
+{
+  if (!lyd->master_started)
+    return;
+  pthread_mutex_lock (&lyd->master_mutex);
+  lyd->master_stop = 1;
+  pthread_mutex_unlock (&lyd->master_mutex);
+  pthread_cond_signal (&lyd->master_cond);
+  pthread_join (lyd->master_tid, NULL);
+  pthread_mutex_destroy (&lyd->master_mutex);
+  pthread_cond_destroy (&lyd->master_cond);
+  lyd->master_started = 0;
+}
+
 void lyd_worker_threads_init (Lyd *lyd)
 {
-  static int done = 0;
   int i;
-  if (done)
+  if (lyd->threads) /* already started for this instance */
     return;
 
   lyd->threads = lyd_get_num_cores ();
   if (lyd->threads > LYD_MAX_THREADS)
     lyd->threads = LYD_MAX_THREADS;
 
-  done = 1;
   for (i = 1;i < lyd->threads; i++)
     {
       ThreadData *tdata = g_new0 (ThreadData, 1);
@@ -164,11 +271,30 @@ void lyd_worker_threads_init (Lyd *lyd)
       pthread_create (&lyd->tids[i], NULL, render_thread, tdata);
     }
 }
+#else
+
+/* without threads the pending period is processed in place */
+static void lyd_master_start (Lyd *lyd, int samples,
+                              void *stream, void *stream2)
+{
+  LydSample *mix[LYD_MAX_CHANNELS];
+  int c;
+  for (c = 0; c < lyd->channels; c++)
+    mix[c] = lyd->pipe_buf + c * samples;
+  lyd_master_stage (lyd, samples, mix, 1, stream, stream2);
+}
+
+static void lyd_master_wait (Lyd *lyd)
+{
+}
 #endif
 
-static void lyd_prepare_buffer (Lyd *lyd, int samples)
+static void lyd_prepare_buffer (Lyd *lyd, int samples, int pipelined,
+                                void *stream, void *stream2)
 {
   int i;
+  if (pipelined && !lyd->pipe_buf)
+    lyd->buf_len = 0;
   if (lyd->buf_len < samples || lyd->buf[0] == NULL)
     {
 #ifdef LYD_THREADED
@@ -179,16 +305,93 @@ static void lyd_prepare_buffer (Lyd *lyd, int samples)
         {
           if (lyd->buf[i])
             g_free (lyd->buf[i]);
-          lyd->buf[i] = g_malloc0 (sizeof (LydSample) * samples * 2);
+          lyd->buf[i] = g_malloc0 (sizeof (LydSample) * samples * lyd->channels);
         }
+      g_free (lyd->pipe_buf);
+      lyd->pipe_buf = NULL;
+      if (pipelined)
+        lyd->pipe_buf = g_malloc0 (sizeof (LydSample) * samples * lyd->channels);
+      lyd->pipe_samples = 0; /* the pending period is dropped */
       lyd->buf_len = samples;
     }
 #ifdef LYD_THREADED
-  for (i = 0; i < lyd->threads; i++)
-#else
-  i=0;
+  for (i = 1; i < lyd->threads; i++)
+    memset (lyd->buf[i], 0, sizeof (LydSample) * samples * lyd->channels);
+#endif
+
+  /* when the caller wants planar float, the master mix is accumulated
+   * directly in the caller's buffers, avoiding a conversion pass, not
+   * possible when they receive the previous period */
+  if (lyd->format == LYD_f32S && lyd->channels == 2 && stream && stream2 &&
+      !pipelined)
+    {
+      lyd->mix[0] = stream;
+      lyd->mix[1] = stream2;
+    }
+  else
+    for (i = 0; i < lyd->channels; i++)
+      lyd->mix[i] = lyd->buf[0] + i * samples;
+
+  for (i = 0; i < lyd->channels; i++)
+    memset (lyd->mix[i], 0, sizeof (LydSample) * samples);
+}
+
+/* clear the bus inputs, (re)allocating them for new buses or larger
+ * periods, done with the lock held since buses are added with it */
+static void lyd_prepare_buses (Lyd *lyd, int samples, int pipelined)
+{
+  int size = sizeof (LydSample) * lyd->buf_len * lyd->channels;
+  int i;
+  for (i = 0; i < lyd->bus_count; i++)
+    {
+      LydBus *bus = lyd->bus[lyd->bus_order[i]];
+      int     threads = 1;
+      int     t;
+#ifdef LYD_THREADED
+      threads = lyd->threads;
 #endif
-    memset (lyd->buf[i], 0, sizeof (LydSample) * samples * 2);
+      if (bus->buf_len < samples)
+        {
+          for (t = 0; t < LYD_MAX_THREADS; t++)
+            {
+              g_free (bus->buf[t]);
+              bus->buf[t] = NULL;
+            }
+          g_free (bus->pending);
+          bus->pending = NULL;
+          bus->buf_len = lyd->buf_len;
+        }
+      for (t = 0; t < threads; t++)
+        {
+          if (!bus->buf[t])
+            bus->buf[t] = g_malloc (size);
+          memset (bus->buf[t], 0, sizeof (LydSample) * samples * lyd->channels);
+        }
+      if (pipelined && !bus->pending)
+        bus->pending = g_malloc0 (size);
+    }
+}
+
+/* compute the global modulators for the period, before any voice reads
+ * them */
+static void lyd_process_globals (Lyd *lyd, int samples)
+{
+  int i;
+  for (i = 0; i < lyd->global_count; i++)
+    {
+      LydGlobal *global = lyd->global[i];
+      if (global->buf_len < samples)
+        {
+          g_free (global->buf);
+          global->buf = g_malloc (sizeof (LydSample) * samples);
+          global->buf_len = samples;
+        }
+      if (global->filter)
+        lyd_filter_process (global->filter, NULL, 0, global->buf, samples);
+      else
+        memset (global->buf, 0, sizeof (LydSample) * samples);
+      global->samples = samples;
+    }
 }
 
 static double elapsed_time = 0.0;
@@ -241,6 +444,105 @@ static void lyd_voice_release_handling (Lyd   *lyd,
       }
 }
 
+void
+lyd_pan_gains (LydSample  position,
+               int        channels,
+               LydSample *gains)
+{
+  float spot;
+  int   c, lower;
+
+  if (channels <= 1)
+    {
+      gains[0] = 1.0;
+      return;
+    }
+  if (position < -1.0)
+    position = -1.0;
+  else if (position > 1.0)
+    position = 1.0;
+
+  /* speakers are spread evenly from -1.0 to 1.0, the voice is panned
+   * between the two speakers closest to it with a sin/cos law, keeping
+   * its power; a voice on a speaker has unity gain, one halfway between
+   * two speakers 0.707 on each
+   */
+  spot  = (position + 1.0) * 0.5 * (channels - 1);
+  lower = spot;
+  if (lower >= channels - 1)
+    lower = channels - 2;
+  spot -= lower;
+
+  for (c = 0; c < channels; c++)
+    gains[c] = 0.0;
+  gains[lower]     = cosf (spot * M_PI_2);
+  gains[lower + 1] = sinf (spot * M_PI_2);
+}
+
+/* the planar channel of the mix buffer a render thread accumulates into
+ * for a bus, thread 0 renders directly into the master mix */
+static inline LydSample *
+lyd_plane (Lyd *lyd, int thread_no, int bus, int channel, int samples)
+{
+  if (bus)
+    return lyd->bus[bus]->buf[thread_no] + channel * samples;
+  if (thread_no == 0)
+    return lyd->mix[channel];
+  return lyd->buf[thread_no] + channel * samples;
+}
+
+/* add count samples of result to the planes with linearly changing gains */
+static void
+lyd_spatialize_into (Lyd        *lyd,
+                     LydSample **planes,
+                     LydSample  *gain,
+                     LydSample  *step,
+                     LydSample   amount,
+                     int         count,
+                     LydSample * __restrict__ result)
+{
+  int channels = lyd->channels;
+  int i, c;
+
+  if (channels == 2)
+    {
+      /* fused stereo kernel, reading result only once */
+      LydSample * __restrict__ left  = planes[0];
+      LydSample * __restrict__ right = planes[1];
+      LydSample l = gain[0] * amount, r = gain[1] * amount;
+      LydSample dl = step[0] * amount, dr = step[1] * amount;
+
+      if (dl == 0.0 && dr == 0.0)
+        for (i = 0; i < count; i++)
+          {
+            left[i]  += result[i] * l;
+            right[i] += result[i] * r;
+          }
+      else
+        for (i = 0; i < count; i++)
+          {
+            left[i]  += result[i] * (l + dl * i);
+            right[i] += result[i] * (r + dr * i);
+          }
+      return;
+    }
+
+  for (c = 0; c < channels; c++)
+    {
+      LydSample * __restrict__ out = planes[c];
+      LydSample g = gain[c] * amount, d = step[c] * amount;
+      if (g == 0.0 && d == 0.0)
+        continue;
+      for (i = 0; i < count; i++)
+        out[i] += result[i] * (g + d * i);
+    }
+}
+
+/* accumulate result into the planar channels of the thread's mix buffer
+ * of the voice's bus and send, when the position has changed since the
+ * previous chunk the gains are ramped linearly across this chunk to avoid
+ * zipper noise.
+ */
 static void
 lyd_voice_spatialize (Lyd   *lyd,
                       LydVM *voice,
@@ -249,30 +551,45 @@ lyd_voice_spatialize (Lyd   *lyd,
                       int    samples,
                       int    tot_samples,
                       int    pos,
-                      LydSample * result)
+                      LydSample * __restrict__ result)
 {
-  int i;
-  /* simple stereo spatialization */
-  if (voice->position == 0.0)
+  LydSample gain[LYD_MAX_CHANNELS];
+  LydSample step[LYD_MAX_CHANNELS];
+  int       channels = lyd->channels;
+  int       count    = samples - first_sample;
+  LydSample *planes[LYD_MAX_CHANNELS];
+  int       c;
+
+  for (c = 0; c < channels; c++)
     {
-      for (i=first_sample;i<samples;i++)
-        lyd->buf[thread_no][pos+i] += result[i-first_sample];
-      for (i=first_sample;i<samples;i++)
-        lyd->buf[thread_no][pos+i+tot_samples] += result[i-first_sample];
+      gain[c] = voice->gain[c];
+      step[c] = 0.0;
     }
-  else if (voice->position > 0.0)
+
+  if (voice->position != voice->gain_position)
     {
-      for (i=first_sample;i<samples;i++)
-        lyd->buf[thread_no][pos+i] += result[i-first_sample] * (1.0-voice->position);
-      for (i=first_sample;i<samples;i++)
-        lyd->buf[thread_no][pos+i+tot_samples] += result[i-first_sample];
+      LydSample target[LYD_MAX_CHANNELS];
+      lyd_pan_gains (voice->position, channels, target);
+      /* the ramp starts a step in, ending on the target with the last
+       * sample of the chunk */
+      for (c = 0; c < channels; c++)
+        {
+          step[c] = (target[c] - gain[c]) / count;
+          gain[c] += step[c];
+          voice->gain[c] = target[c];
+        }
+      voice->gain_position = voice->position;
     }
-  else
+
+  for (c = 0; c < channels; c++)
+    planes[c] = lyd_plane (lyd, thread_no, voice->bus, c, tot_samples) + pos + first_sample;
+  lyd_spatialize_into (lyd, planes, gain, step, 1.0, count, result);
+
+  if (voice->send)
     {
-      for (i=first_sample;i<samples;i++)
-        lyd->buf[thread_no][pos+i] += result[i - first_sample];
-      for (i=first_sample;i<samples;i++)
-        lyd->buf[thread_no][pos+i+tot_samples] += result[i - first_sample] * (1.0+voice->position);
+      for (c = 0; c < channels; c++)
+        planes[c] = lyd_plane (lyd, thread_no, voice->send, c, tot_samples) + pos + first_sample;
+      lyd_spatialize_into (lyd, planes, gain, step, voice->send_amount, count, result);
     }
 }
 
@@ -285,6 +602,7 @@ lyd_synthesize_voice (Lyd   *lyd,
                       int    pos)
 {
   LydSample * __restrict__ result = NULL;
+  LydSample scratch[LYD_CHUNK];
   int first_sample = voice->sample<0?-voice->sample:0;
 
   /* blanking accumulation buffer... */
@@ -300,11 +618,25 @@ lyd_synthesize_voice (Lyd   *lyd,
 
   voice->sample += first_sample;
 
+  if (voice->catch_up == 1)
+    lyd_notes_catch_up (voice);
+  if (voice->replay && !voice->catch_up)
+    {
+      /* a cached rendering of this note, see lyd-notes.c */
+      result = lyd_notes_replay (voice, samples - first_sample, scratch);
+      lyd_voice_spatialize (lyd, voice, thread_no, first_sample, samples, tot_samples, pos, result);
+      lyd_voice_release_handling  (lyd, voice, first_sample, samples, result);
+      return;
+    }
+
   voice->sample++;
+  voice->period_pos = pos + first_sample;
   lyd_vm_update_params (voice, samples - first_sample);
 
   /* result is a direct pointer to the results in the last processing chain */
   result = lyd_vm_compute (voice, samples - first_sample);
+  if (voice->record)
+    lyd_notes_record (voice, result, samples - first_sample);
   lyd_voice_spatialize (lyd, voice, thread_no, first_sample, samples, tot_samples, pos, result);
   voice->sample--;
 
@@ -325,6 +657,10 @@ static SList *lyd_queue_voices (Lyd *lyd, int samples)
       LydVM *voice = iter->data;
       if (voice->sample + samples >=0)
         {
+          if (!voice->note_checked)
+            lyd_notes_start (lyd, voice);
+          if (voice->replay)
+            lyd_notes_follow (lyd, voice, samples);
           lyd->queued_voices[thread_no] = slist_prepend (lyd->queued_voices[thread_no], voice);
           active = slist_prepend (active, voice);
         }
@@ -367,91 +703,306 @@ static void lyd_thread_render_voices (Lyd *lyd, int samples, int thread_no)
 
 #ifdef LYD_THREADED
 
+/* sum what the render threads accumulated into the master mix and the
+ * first input of each bus */
 static void lyd_collapse_threads (Lyd *lyd, int samples)
 {
-  int i;
+  int i, c, j, b;
   for (i = 1; i < lyd->threads; i++)
     {
-      int j;
-      for (j = 0; j < samples * 2; j++)
-        lyd->buf[0][j] += lyd->buf[i][j];
+      for (c = 0; c < lyd->channels; c++)
+        {
+          LydSample * __restrict__ dst = lyd->mix[c];
+          LydSample * __restrict__ src = lyd->buf[i] + c * samples;
+          for (j = 0; j < samples; j++)
+            dst[j] += src[j];
+        }
+      for (b = 0; b < lyd->bus_count; b++)
+        {
+          LydBus *bus = lyd->bus[lyd->bus_order[b]];
+          LydSample * __restrict__ dst = bus->buf[0];
+          LydSample * __restrict__ src = bus->buf[i];
+          for (j = 0; j < samples * lyd->channels; j++)
+            dst[j] += src[j];
+        }
     }
 }
 #endif
 
-static void lyd_apply_global_filter (Lyd *lyd, int samples)
+/* everything done to the mixed voices before they reach the caller, mix
+ * is the planar master mix, and pending selects the bus inputs of the
+ * period held back when pipelined */
+static void lyd_master_stage (Lyd        *lyd,
+                              int         samples,
+                              LydSample **mix,
+                              int         pending,
+                              void       *stream,
+                              void       *stream2)
+{
+  lyd_process_buses (lyd, samples, mix, pending);
+  lyd_apply_global_filter (lyd, samples, mix, pending);
+  lyd_scale_volume (lyd, samples, mix);
+  lyd_write_to_output (lyd, samples, mix, stream, stream2);
+}
+
+/* hold back the period just rendered for the master stage of the next call */
+static void lyd_pipeline_swap (Lyd *lyd, int samples)
+{
+  LydSample *tmp;
+  int i;
+
+  tmp = lyd->buf[0];
+  lyd->buf[0] = lyd->pipe_buf;
+  lyd->pipe_buf = tmp;
+  for (i = 0; i < lyd->bus_count; i++)
+    {
+      LydBus *bus = lyd->bus[lyd->bus_order[i]];
+      tmp = bus->buf[0];
+      bus->buf[0] = bus->pending;
+      bus->pending = tmp;
+    }
+  /* and the globals the period was rendered with, for its bus effects */
+  for (i = 0; i < lyd->global_count; i++)
+    {
+      LydGlobal *global = lyd->global[i];
+      int        len = global->buf_len;
+      int        valid = global->samples;
+      tmp = global->buf;
+      global->buf = global->pending;
+      global->buf_len = global->pending_len;
+      global->samples = global->pending_samples;
+      global->pending = tmp;
+      global->pending_len = len;
+      global->pending_samples = valid;
+    }
+  lyd->pipe_samples = samples;
+}
+
+/* run the effect of every bus once, deepest first so that buses feeding
+ * other buses are done before them, and mix the results into their
+ * outputs */
+static void lyd_process_buses (Lyd        *lyd,
+                               int         samples,
+                               LydSample **mix,
+                               int         pending)
+{
+  int i, c, j;
+
+  for (i = 0; i < lyd->bus_count; i++)
+    {
+      LydBus    *bus = lyd->bus[lyd->bus_order[i]];
+      LydSample *in  = pending ? bus->pending : bus->buf[0];
+      LydSample *out = NULL;
+      if (bus->output)
+        out = pending ? lyd->bus[bus->output]->pending
+                      : lyd->bus[bus->output]->buf[0];
+      for (c = 0; c < lyd->channels; c++)
+        {
+          LydSample * __restrict__ plane = in + c * samples;
+          LydSample * __restrict__ dst;
+          if (bus->filter[c])
+            {
+              LydSample *inputs[] = {plane};
+              bus->filter[c]->pending_globals = pending;
+              lyd_filter_process (bus->filter[c], inputs, 1, plane, samples);
+            }
+          dst = out ? out + c * samples : mix[c];
+          for (j = 0; j < samples; j++)
+            dst[j] += plane[j];
+        }
+    }
+}
+
+static void lyd_apply_global_filter (Lyd        *lyd,
+                                     int         samples,
+                                     LydSample **mix,
+                                     int         pending)
 {
   LydSample *inputs[]={NULL};
-  inputs[0] = lyd->buf[0];
+  inputs[0] = mix[0];
   if (lyd->global_filter[0])
-    lyd_filter_process (lyd->global_filter[0], inputs, 1, lyd->buf[0], samples);
-  inputs[0] = lyd->buf[0] + samples;
-  if (lyd->global_filter[1])
-    lyd_filter_process (lyd->global_filter[1], inputs, 1, lyd->buf[0] + samples, samples);
+    {
+      lyd->global_filter[0]->pending_globals = pending;
+      lyd_filter_process (lyd->global_filter[0], inputs, 1, mix[0], samples);
+    }
+  inputs[0] = mix[1];
+  if (lyd->global_filter[1] && lyd->channels > 1)
+    {
+      lyd->global_filter[1]->pending_globals = pending;
+      lyd_filter_process (lyd->global_filter[1], inputs, 1, mix[1], samples);
+    }
 }
 
-static void lyd_scale_volume (Lyd *lyd, int samples)
+/* peak absolute value of count samples from start in all the planes */
+static LydSample
+lyd_peak (LydSample **planes, int start, int channels, int count)
 {
-  int i;
-  float factor = lyd->i_voice_count;
-  for (i=0;i<samples;i++)
+  LydSample peak = 0.0;
+  int c, i;
+  for (c = 0; c < channels; c++)
     {
-      LydSample value[2];
-      value[0] = lyd->buf[0][i];
-      value[1] = lyd->buf[0][i+samples];
+      LydSample * __restrict__ src = planes[c] + start;
+      for (i = 0; i < count; i++)
+        {
+          LydSample level = fabsf (src[i]);
+          peak = level > peak ? level : peak;
+        }
+    }
+  return peak;
+}
 
-      {
-        LydSample level = fabsf(value[0]);
-        if (level > lyd->level)
-          lyd->level = level;
-        level = fabsf(value[1]);
-        if (level > lyd->level)
-          lyd->level = level;
-      }
+/* the gain needed to bring a block with the given peak below the ceiling */
+static inline LydSample
+lyd_limiter_target (LydSample peak, LydSample scale)
+{
+  peak *= scale;
+  if (peak > LYD_LIMITER_CEILING)
+    return LYD_LIMITER_CEILING / peak;
+  return 1.0;
+}
 
-      if (lyd->level > lyd->voice_count)
+/* scales the mix down by the voice count, and runs it through a lookahead
+ * peak limiter. The mix is delayed by LYD_LIMITER_LOOKAHEAD samples in a
+ * ring, and processed in blocks of one trip around the ring, running on
+ * from one period into the next. While a block is played out of the ring
+ * the following one arrives into it, the gain ramps linearly across the
+ * block towards the smallest target gain of the two, lowered as more of
+ * the following block arrives, so the gain has been reduced by the time a
+ * peak reaches the output. Every sample is scanned for peaks once, as it
+ * arrives.
+ */
+static void lyd_scale_volume (Lyd *lyd, int samples, LydSample **mix)
+{
+  const int  L        = LYD_LIMITER_LOOKAHEAD;
+  int        channels = lyd->channels;
+  LydSample  scale    = lyd->i_voice_count;
+  LydSample  gain     = lyd->limiter_gain;
+  LydSample  end_gain = lyd->limiter_end;
+  LydSample  peak     = lyd->limiter_peak;
+  int        pos      = lyd->limiter_pos;
+  LydSample  release  = 1.0 - expf (-L / (LYD_LIMITER_RELEASE * lyd->sample_rate));
+  int        start, c, i;
+
+  for (start = 0; start < samples; )
+    {
+      int       count = samples - start < L - pos ? samples - start : L - pos;
+      LydSample step, next_target;
+
+      if (pos == 0)
         {
-          factor = 1.0/lyd->level;
-          lyd->buf[0][i] *= factor;
-          lyd->buf[0][i+samples] *= factor;
+          /* the block that arrived during the last trip plays out now */
+          end_gain = lyd_limiter_target (peak, scale);
+          if (end_gain > gain) /* recover slowly, attack within lookahead */
+            end_gain = gain + (end_gain - gain) * release;
+          peak = 0.0;
         }
-      else
+
+      peak = fmaxf (peak, lyd_peak (mix, start, channels, count));
+      next_target = lyd_limiter_target (peak, scale);
+      end_gain = end_gain < next_target ? end_gain : next_target;
+      step = (end_gain - gain) / (L - pos);
+
+      for (c = 0; c < channels; c++)
         {
-          lyd->buf[0][i] *= factor;
-          lyd->buf[0][i+samples] *= factor;
+          LydSample * __restrict__ delay = lyd->limiter_delay[c] + pos;
+          LydSample * __restrict__ dst   = mix[c] + start;
+          for (i = 0; i < count; i++)
+            {
+              LydSample in = dst[i];
+              dst[i]   = delay[i] * scale * (gain + step * i);
+              delay[i] = in;
+            }
         }
+
+      gain  += step * count;
+      pos    = (pos + count) % L;
+      start += count;
     }
+  lyd->limiter_gain = gain;
+  lyd->limiter_end  = end_gain;
+  lyd->limiter_peak = peak;
+  lyd->limiter_pos  = pos;
 }
 
-static void lyd_write_to_output (Lyd *lyd, int samples,
+#define SATURATE(v) ((v) > 1.0f ? 1.0f : (v) < -1.0f ? -1.0f : (v))
+
+/* the largest float below 2^31, 2^31 itself does not fit in an int32 */
+#define S32_MAX_F 2147483520.0f
+
+/* convert the master mix into the requested output format, all conversions
+ * are branch free loops (saturating with min/max) that gcc vectorizes.
+ */
+static void lyd_write_to_output (Lyd *lyd, int samples, LydSample **mix,
                                  void *stream, void *stream2)
 {
-  int i;
+  int i, c;
+  int channels = lyd->channels;
+  LydSample * __restrict__ left  = mix[0];
+  LydSample * __restrict__ right = mix[lyd->channels > 1];
   LydSample * __restrict__ buf   = (void*)stream;
   LydSample * __restrict__ buf2  = (void*)stream2;
-  short int * __restrict__ buf16 = (void*)stream;
+  int16_t   * __restrict__ buf16 = (void*)stream;
+  int32_t   * __restrict__ buf32 = (void*)stream;
   /* write from accumbuf into actual buffer */
   switch (lyd->format)
     {
       case LYD_f32:
         for (i=0;i<samples;i++)
-          buf[i] = (lyd->buf[0][i] + lyd->buf[0][i+samples])/2;
+          {
+            LydSample v = (left[i] + right[i]) * 0.5f;
+            buf[i] = SATURATE (v);
+          }
         break;
-      case LYD_f32S:
+      case LYD_f32S: /* also clamps in place when mixed into the streams */
         for (i=0;i<samples;i++)
-          buf[i] = lyd->buf[0][i];
+          buf[i] = SATURATE (left[i]);
         for (i=0;i<samples;i++)
-          buf2[i] = lyd->buf[0][i+samples];
+          buf2[i] = SATURATE (right[i]);
         break;
-      case LYD_s16S:
+      case LYD_f32I:
         for (i=0;i<samples;i++)
-          buf16[i*2]  = (lyd->buf[0][i] * 32767);
+          {
+            buf[i*2]   = SATURATE (left[i]);
+            buf[i*2+1] = SATURATE (right[i]);
+          }
+        break;
+      case LYD_s16S:
         for (i=0;i<samples;i++)
-          buf16[i*2+1] = (lyd->buf[0][i+samples] * 32767);
+          {
+            buf16[i*2]   = SATURATE (left[i]) * 32767.0f;
+            buf16[i*2+1] = SATURATE (right[i]) * 32767.0f;
+          }
         break;
       case LYD_s16:
         for (i=0;i<samples;i++)
-          buf16[i] = ((lyd->buf[0][i] + lyd->buf[0][i + samples])/2) * 32767;
+          {
+            LydSample v = (left[i] + right[i]) * 0.5f;
+            buf16[i] = SATURATE (v) * 32767.0f;
+          }
+        break;
+      case LYD_s24S:
+        for (i=0;i<samples;i++)
+          {
+            buf32[i*2]   = SATURATE (left[i]) * 8388607.0f;
+            buf32[i*2+1] = SATURATE (right[i]) * 8388607.0f;
+          }
+        break;
+      case LYD_s32S:
+        for (i=0;i<samples;i++)
+          {
+            LydSample l = left[i] * 2147483648.0f;
+            LydSample r = right[i] * 2147483648.0f;
+            buf32[i*2]   = l > S32_MAX_F ? S32_MAX_F : l < -2147483648.0f ? -2147483648.0f : l;
+            buf32[i*2+1] = r > S32_MAX_F ? S32_MAX_F : r < -2147483648.0f ? -2147483648.0f : r;
+          }
+        break;
+      case LYD_f32N:
+        for (c=0;c<channels;c++)
+          {
+            LydSample * __restrict__ src = mix[c];
+            for (i=0;i<samples;i++)
+              buf[i*channels+c] = SATURATE (src[i]);
+          }
         break;
     }
 }
@@ -472,6 +1023,7 @@ static void lyd_kill_silent_voices (Lyd *lyd, SList *active)
           lyd->voices = slist_remove (lyd->voices, voice);
           if (voice->complete_cb)
             (voice->complete_cb) (voice->complete_data);
+          lyd_notes_store (lyd, voice);
           lyd_vm_free (voice);
           iter->data = NULL;
         }
@@ -0,0 +1,538 @@
+/*
+ * Copyright (c) 2010 Øyvind Kolås <pippin@gimp.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Rendered note cache.
+ *
+ * A voice of a program without noise, inputs or shared modulators, that
+ * gets no parameter changes once started, produces the same samples for
+ * the same variable values and duration. The first such voice records its
+ * output, and when it ends naturally the recording is kept in an LRU cache
+ * keyed by program, variables and duration. Later identical voices replay
+ * the recording instead of running their vm. Ops reading waves are taken as
+ * deterministic too, the key also holds the compile_version, which replacing
+ * a wave or adding an op bumps, so recordings made before are not replayed.
+ *
+ * Releasing a voice early is part of the key too, a recording notes the
+ * sample it was released at. A replaying voice released somewhere else, or
+ * not released where its recording was, moves on to a recording that
+ * matches it from there if there is one, otherwise it records one: its vm
+ * is caught up by rendering silently up to the current position, in the
+ * render thread, and continues live. A voice that has its parameters or
+ * duration changed while playing is caught up the same way, but no longer
+ * recorded.
+ *
+ * Lookups, stores and evictions happen with the lyd lock held, recording,
+ * replaying and catching up in the render threads only touch the voice's
+ * own entry.
+ */
+
+#include <string.h>
+#include "lyd-private.h"
+
+struct _LydNote
+{
+  LydNote    *next;    /* in the hash bucket */
+  LydNote    *newer;   /* LRU order */
+  LydNote    *older;
+  unsigned    hash;
+  LydProgram *program; /* referenced while the note exists */
+  int         n_values;
+  LydSample  *values;  /* of the variables */
+  LydSample   duration;
+  long        release; /* sample the voice was released at, -1 if it was
+                          not released before its duration ran out */
+  int         sample_rate;
+  int         version; /* compile_version, waves or ops may have changed */
+  int         users;   /* voices replaying the note */
+  int         cached;  /* in the cache, otherwise freed with the last user */
+  LydSample  *pcm;
+  int         length;
+  int         size;
+};
+
+static int lyd_op_deterministic (Lyd *lyd, LydOpCode op);
+
+static int lyd_program_deterministic (Lyd *lyd, LydProgram *program)
+{
+  int i;
+  if (!program->deterministic)
+    {
+      program->deterministic = 1;
+      for (i = 0; program->commands[i].op; i++)
+        if (!lyd_op_deterministic (lyd, program->commands[i].op))
+          {
+            program->deterministic = -1;
+            break;
+          }
+    }
+  return program->deterministic > 0;
+}
+
+/* ops whose output only depends on their arguments and the voice time */
+static int lyd_op_deterministic (Lyd *lyd, LydOpCode op)
+{
+  switch (op)
+    {
+      case LYD_NOISE:  /* shared random sequence */
+      case LYD_PLUCK:  /* seeded from noise */
+      case LYD_PLUCK_UNISON:
+      case LYD_GRAINS:
+      case LYD_INPUT:
+      case LYD_INPUTP:
+      case LYD_GLOBAL:
+        return 0;
+      default:
+        break;
+    }
+  if (op < LydLastOp)
+    return 1;
+#ifdef LYD_EXTENDABLE
+  {
+    SList *iter;
+    for (iter = lyd->op_info; iter; iter = iter->next)
+      {
+        LydOpInfo *info = iter->data;
+        if (info->op == op)
+          return info->program && !info->process &&
+                 lyd_program_deterministic (lyd, info->program);
+      }
+  }
+#endif
+  return 0;
+}
+
+/* fill in the key of the note voice would play */
+static void lyd_note_key (LydVM *voice, LydNote *note)
+{
+  LydOpState *state;
+  unsigned    hash = 2166136261u;
+  unsigned char *p;
+  size_t      i;
+
+  note->program = voice->program;
+  note->duration = voice->duration;
+  note->release = -1;
+  note->sample_rate = voice->sample_rate;
+  note->version = voice->lyd->compile_version;
+  note->n_values = 0;
+  for (state = voice->state; state->op == LYD_NOP; state = state->next)
+    note->n_values++;
+  note->values = g_malloc (sizeof (LydSample) * (note->n_values + 1));
+  note->n_values = 0;
+  for (state = voice->state; state->op == LYD_NOP; state = state->next)
+    note->values[note->n_values++] = state->literal[0][0];
+
+  p = (void*)&note->program;
+  for (i = 0; i < sizeof (note->program); i++)
+    hash = (hash ^ p[i]) * 16777619u;
+  p = (void*)note->values;
+  for (i = 0; i < sizeof (LydSample) * note->n_values; i++)
+    hash = (hash ^ p[i]) * 16777619u;
+  p = (void*)&note->duration;
+  for (i = 0; i < sizeof (note->duration); i++)
+    hash = (hash ^ p[i]) * 16777619u;
+  hash = (hash ^ note->version) * 16777619u;
+  note->hash = hash;
+}
+
+/* whether a and b are the same note up to where they were released, the
+ * hash leaves the release out so they share a bucket */
+static int lyd_note_same (LydNote *a, LydNote *b)
+{
+  return a->hash == b->hash &&
+         a->program == b->program &&
+         a->duration == b->duration &&
+         a->sample_rate == b->sample_rate &&
+         a->version == b->version &&
+         a->n_values == b->n_values &&
+         !memcmp (a->values, b->values, sizeof (LydSample) * a->n_values);
+}
+
+static int lyd_note_equal (LydNote *a, LydNote *b)
+{
+  return lyd_note_same (a, b) && a->release == b->release;
+}
+
+static void lyd_note_free (LydNote *note)
+{
+  lyd_program_unref (note->program);
+  g_free (note->values);
+  g_free (note->pcm);
+  g_free (note);
+}
+
+static void lyd_note_unref (LydNote *note)
+{
+  if (--note->users == 0 && !note->cached)
+    lyd_note_free (note);
+}
+
+static void lyd_note_unlink (Lyd *lyd, LydNote *note)
+{
+  LydNote **link = &lyd->note_bucket[note->hash & (LYD_NOTE_BUCKETS - 1)];
+  while (*link != note)
+    link = &(*link)->next;
+  *link = note->next;
+
+  if (note->newer)
+    note->newer->older = note->older;
+  else
+    lyd->note_newest = note->older;
+  if (note->older)
+    note->older->newer = note->newer;
+  else
+    lyd->note_oldest = note->newer;
+
+  lyd->note_cache_size -= sizeof (LydSample) * note->length;
+  note->cached = 0;
+  if (!note->users)
+    lyd_note_free (note);
+}
+
+static void lyd_note_make_newest (Lyd *lyd, LydNote *note)
+{
+  if (lyd->note_newest == note)
+    return;
+  if (note->newer)
+    note->newer->older = note->older;
+  if (note->older)
+    note->older->newer = note->newer;
+  else if (lyd->note_oldest == note)
+    lyd->note_oldest = note->newer;
+
+  note->older = lyd->note_newest;
+  note->newer = NULL;
+  if (lyd->note_newest)
+    lyd->note_newest->newer = note;
+  lyd->note_newest = note;
+  if (!lyd->note_oldest)
+    lyd->note_oldest = note;
+}
+
+/* a cached recording of key that is released at release, or with release
+ * -1, one that plays unreleased at least up to sample from, preferring
+ * the one released latest */
+static LydNote *lyd_note_find (Lyd *lyd, LydNote *key, long release, long from)
+{
+  LydNote *note, *found = NULL;
+  for (note = lyd->note_bucket[key->hash & (LYD_NOTE_BUCKETS - 1)];
+       note; note = note->next)
+    if (lyd_note_same (note, key))
+      {
+        if (release >= 0)
+          {
+            if (note->release == release)
+              return note;
+          }
+        else if (note->release < 0)
+          return note;
+        else if (note->release >= from &&
+                 (!found || note->release > found->release))
+          found = note;
+      }
+  return found;
+}
+
+/* a new recording with the key of note */
+static LydNote *lyd_note_new (LydNote *key, long release)
+{
+  LydNote *note = g_malloc (sizeof (LydNote));
+  *note = *key;
+  note->values = g_malloc (sizeof (LydSample) * (key->n_values + 1));
+  memcpy (note->values, key->values, sizeof (LydSample) * key->n_values);
+  note->release = release;
+  note->next = note->newer = note->older = NULL;
+  note->users = 0;
+  note->cached = 0;
+  note->pcm = NULL;
+  note->length = note->size = 0;
+  pthread_mutex_lock (&note->program->mutex);
+  note->program->ref_count++;
+  pthread_mutex_unlock (&note->program->mutex);
+  return note;
+}
+
+static void lyd_note_replay (Lyd *lyd, LydVM *voice, LydNote *note)
+{
+  lyd->note_hits++;
+  note->users++;
+  lyd_note_make_newest (lyd, note);
+  voice->replay = note;
+}
+
+/* called when voice is about to play its first samples */
+void lyd_notes_start (Lyd *lyd, LydVM *voice)
+{
+  LydNote  key;
+  LydNote *note;
+
+  voice->note_checked = 1;
+  if (!lyd->note_cache_max || voice->params || voice->released ||
+      voice->duration <= 0 || !lyd_program_deterministic (lyd, voice->program))
+    return;
+
+  lyd_note_key (voice, &key);
+  note = lyd_note_find (lyd, &key, -1, 0);
+  if (note)
+    lyd_note_replay (lyd, voice, note);
+  else
+    {
+      lyd->note_misses++;
+      voice->record = lyd_note_new (&key, -1);
+    }
+  g_free (key.values);
+}
+
+/* voice no longer plays what it replays, replay next instead, or when
+ * that is NULL have the vm caught up and record from the start, the
+ * recording released at release */
+static void lyd_notes_switch (Lyd *lyd, LydVM *voice, LydNote *next,
+                              long release)
+{
+  if (next)
+    {
+      lyd_note_unref (voice->replay);
+      lyd_note_replay (lyd, voice, next);
+      return;
+    }
+  lyd->note_misses++;
+  voice->record = lyd_note_new (voice->replay, release);
+  voice->catch_up = 1;
+}
+
+/* called before voice, replaying, plays samples more; moves it on to
+ * another recording when its own was released within them */
+void lyd_notes_follow (Lyd *lyd, LydVM *voice, int samples)
+{
+  LydNote *note = voice->replay;
+
+  if (voice->catch_up == 2) /* caught up by the render thread */
+    {
+      lyd_note_unref (note);
+      voice->replay = NULL;
+      voice->catch_up = 0;
+      return;
+    }
+  if (voice->catch_up || note->release < voice->sample ||
+      note->release >= voice->sample + samples ||
+      (note->release == voice->sample && voice->released))
+    return;
+
+  lyd_notes_switch (lyd, voice, lyd_note_find (lyd, note, -1,
+                                               voice->sample + samples), -1);
+}
+
+/* append the samples just computed by voice to its recording */
+void lyd_notes_record (LydVM *voice, LydSample *result, int samples)
+{
+  LydNote *note = voice->record;
+
+  if (note->length + samples > note->size)
+    {
+      int size = note->size ? note->size * 2 : voice->sample_rate;
+      while (size < note->length + samples)
+        size *= 2;
+      if (sizeof (LydSample) * (long)size > voice->lyd->note_cache_max * 2)
+        { /* too long to ever be cached */
+          lyd_note_free (note);
+          voice->record = NULL;
+          return;
+        }
+      note->pcm = g_realloc (note->pcm, sizeof (LydSample) * size);
+      note->size = size;
+    }
+  memcpy (note->pcm + note->length, result, sizeof (LydSample) * samples);
+  note->length += samples;
+}
+
+/* the next samples of a replaying voice, scratch holds LYD_CHUNK samples
+ * for the part past the end of the recording */
+LydSample *lyd_notes_replay (LydVM *voice, int samples, LydSample *scratch)
+{
+  LydNote *note = voice->replay;
+  long     pos = voice->sample;
+  int      avail = note->length - pos;
+
+  voice->sample += samples;
+  if (avail >= samples)
+    return note->pcm + pos;
+  if (avail < 0)
+    avail = 0;
+  if (avail)
+    memcpy (scratch, note->pcm + pos, sizeof (LydSample) * avail);
+  memset (scratch + avail, 0, sizeof (LydSample) * (samples - avail));
+  return scratch;
+}
+
+static void lyd_notes_trim (Lyd *lyd, long max)
+{
+  while (lyd->note_cache_size > max && lyd->note_oldest)
+    lyd_note_unlink (lyd, lyd->note_oldest);
+}
+
+/* voice ended on its own, keep what it recorded */
+void lyd_notes_store (Lyd *lyd, LydVM *voice)
+{
+  LydNote  *note = voice->record;
+  LydNote **bucket;
+  LydNote  *iter;
+  long      bytes;
+
+  if (!note)
+    return;
+  voice->record = NULL;
+
+  /* voices overlapping the first one also recorded the note */
+  bucket = &lyd->note_bucket[note->hash & (LYD_NOTE_BUCKETS - 1)];
+  for (iter = *bucket; iter; iter = iter->next)
+    if (lyd_note_equal (iter, note))
+      break;
+
+  /* replaying pads with silence, no need to keep the tail */
+  while (note->length && note->pcm[note->length - 1] == 0.0)
+    note->length--;
+
+  bytes = sizeof (LydSample) * note->length;
+  if (iter || bytes > lyd->note_cache_max)
+    {
+      lyd_note_free (note);
+      return;
+    }
+  lyd_notes_trim (lyd, lyd->note_cache_max - bytes);
+
+  note->pcm = g_realloc (note->pcm, bytes);
+  note->size = note->length;
+  note->next = *bucket;
+  *bucket = note;
+  note->cached = 1;
+  lyd_note_make_newest (lyd, note);
+  lyd->note_cache_size += bytes;
+}
+
+/* voice is about to be released, called with the lock held */
+void lyd_notes_release (Lyd *lyd, LydVM *voice)
+{
+  if (voice->released) /* already, or its duration ran out */
+    return;
+  if (voice->record)
+    voice->record->release = voice->sample;
+  else if (voice->replay && !voice->catch_up &&
+           voice->replay->release != voice->sample)
+    lyd_notes_switch (lyd, voice, lyd_note_find (lyd, voice->replay,
+                                                 voice->sample, 0),
+                      voice->sample);
+}
+
+/* voice is about to be changed while playing and no longer plays the
+ * cached note, called with the lock held */
+void lyd_notes_detach (LydVM *voice)
+{
+  if (voice->record)
+    {
+      lyd_note_free (voice->record);
+      voice->record = NULL;
+    }
+  if (voice->replay && !voice->catch_up)
+    voice->catch_up = 1;
+}
+
+/* bring the vm of voice to where its recording got, in the render thread
+ * and as the recording was made: with the variable values, duration and
+ * release of the note */
+void lyd_notes_catch_up (LydVM *voice)
+{
+  LydNote    *note = voice->replay;
+  LydOpState *state;
+  long        target = voice->sample;
+  int         released = voice->released;
+  LydSample   duration = voice->duration;
+  int         i, k;
+
+  /* the current values wait in the phase, which variables do not use */
+  for (state = voice->state, i = 0; state->op == LYD_NOP;
+       state = state->next, i++)
+    {
+      state->phase = state->literal[0][0];
+      for (k = 0; k < LYD_CHUNK; k++)
+        state->literal[0][k] = note->values[i];
+    }
+  voice->duration = note->duration;
+  voice->sample = 0;
+  voice->released = 0;
+  while (voice->sample < target)
+    {
+      LydSample *result;
+      int        samples = target - voice->sample;
+      if (samples > LYD_CHUNK)
+        samples = LYD_CHUNK;
+      if (voice->sample < note->release &&
+          voice->sample + samples > note->release)
+        samples = note->release - voice->sample;
+      if (voice->sample == note->release)
+        voice->released++;
+      voice->sample++;
+      lyd_vm_update_params (voice, samples);
+      result = lyd_vm_compute (voice, samples);
+      voice->sample--;
+      if (voice->record)
+        lyd_notes_record (voice, result, samples);
+      if (voice->sample >= voice->duration || voice->released)
+        voice->released += samples;
+    }
+  for (state = voice->state; state->op == LYD_NOP; state = state->next)
+    for (k = 0; k < LYD_CHUNK; k++)
+      state->literal[0][k] = state->phase;
+  voice->duration = duration;
+  voice->released = released;
+  voice->catch_up = 2; /* replay is let go of by lyd_notes_follow */
+}
+
+void lyd_notes_voice_free (LydVM *voice)
+{
+  if (voice->record)
+    lyd_note_free (voice->record);
+  if (voice->replay)
+    lyd_note_unref (voice->replay);
+  voice->record = voice->replay = NULL;
+}
+
+void lyd_notes_flush (Lyd *lyd)
+{
+  lyd_notes_trim (lyd, 0);
+}
+
+void lyd_set_note_cache (Lyd *lyd, long bytes)
+{
+  LOCK ();
+  lyd->note_cache_max = bytes;
+  lyd_notes_trim (lyd, bytes);
+  UNLOCK ();
+}
+
+void lyd_get_note_cache_stats (Lyd  *lyd,
+                               long *hits,
+                               long *misses,
+                               long *bytes)
+{
+  LOCK ();
+  if (hits)
+    *hits = lyd->note_hits;
+  if (misses)
+    *misses = lyd->note_misses;
+  if (bytes)
+    *bytes = lyd->note_cache_size;
+  UNLOCK ();
+}
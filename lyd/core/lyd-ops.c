@@ -116,25 +116,114 @@ static inline void op_ddadsr (OP_ARGS)
 
 static inline void op_filter (OP_ARGS)
 {
-  int i = 0;
-  ALIGNED_ARGS;
+  LydSample gain = state->arg[0][0],
+            hz   = state->arg[1][0],
+            bw   = state->arg[2][0];
   if (G_UNLIKELY (!DATA))
     DATA = BiQuad_new(state->op-LYD_LOW_PASS,/* compute the right biquad-enum */
-                      ARG0(0),ARG0(1), vm->sample_rate, ARG0(2));
+                      gain, hz, vm->sample_rate, bw);
 
-  /* always updating the filter is expensive, so we do it once per chunk  */
-  BiQuad_update (DATA,state->op-LYD_LOW_PASS,/* compute the right biquad-enum */
-                 ARG0(0),ARG0(1), vm->sample_rate,ARG0(2));
+  /* the coefficients are only recomputed when the parameters change, and
+   * then approached sample by sample over the chunk */
+  if (G_UNLIKELY (BiQuad_changed (DATA, gain, hz, vm->sample_rate, bw)))
+    {
+      biquad  *b = DATA;
+      smp_type from[5] = {b->a0, b->a1, b->a2, b->a3, b->a4};
+      BiQuad_update (DATA,state->op-LYD_LOW_PASS,/* compute the right biquad-enum */
+                     gain, hz, vm->sample_rate, bw);
+      BiQuad_ramp (DATA, from, state->arg[3], state->out, samples);
+    }
+  else
+    BiQuad_block (DATA, state->arg[3], state->out, samples);
+}
 
-  for (i=0; i<samples; i++)
-    OUT = BiQuad(ARG(3), DATA);
+static inline void op_filter_free (LydOpState *state)
+{
+  free (state->data);
+}
+
+/**********************************************************************/
 
+/* x ^ power for a power given as a constant, the cases listed are the ones
+ * the compiler rewrites ^ into */
+static inline void op_powi (OP_ARGS)
+{
+  float power = state->arg[1][0];
+  int   i;
+  ALIGNED_ARGS;
+
+  if (power == 2.0)
+    for (i = 0; i < samples; i++)
+      OUT = ARG(0) * ARG(0);
+  else if (power == 3.0)
+    for (i = 0; i < samples; i++)
+      OUT = ARG(0) * ARG(0) * ARG(0);
+  else if (power == 4.0)
+    for (i = 0; i < samples; i++)
+      {
+        float x2 = ARG(0) * ARG(0);
+        OUT = x2 * x2;
+      }
+  else if (power == -1.0)
+    for (i = 0; i < samples; i++)
+      OUT = 1.0f / ARG(0);
+  else if (power == -2.0)
+    for (i = 0; i < samples; i++)
+      OUT = 1.0f / (ARG(0) * ARG(0));
+  else if (power == 0.5)
+    for (i = 0; i < samples; i++)
+      OUT = sqrtf (ARG(0));
+  else
+    for (i = 0; i < samples; i++)
+      OUT = powf (ARG(0), power);
   ALIGNED_ARGS_SILENCE;
 }
 
-static inline void op_filter_free (LydOpState *state)
+/* fmodf (x, modulus) for a constant modulus, truncating x / modulus
+ * computed as a multiplication, the result keeps the sign of x */
+static inline void op_wrap (OP_ARGS)
 {
-  free (state->data);
+  float m = fabsf (state->arg[1][0]);
+  float r;
+  int   i;
+  ALIGNED_ARGS;
+
+  if (m == 0.0)
+    {
+      memset (state->out, 0, sizeof (LydSample) * samples);
+      return;
+    }
+  r = 1.0f / m;
+  for (i = 0; i < samples; i++)
+    {
+      float x = ARG(0);
+      float q = x * r;
+      float v;
+
+      if (fabsf (q) < 8388608.0f)
+        {
+          v = x - (int)q * m;
+          /* the rounded reciprocal can leave v a modulus off */
+          if (x >= 0.0f)
+            {
+              if (v < 0.0f)
+                v += m;
+              else if (v >= m)
+                v -= m;
+            }
+          else
+            {
+              if (v > 0.0f)
+                v -= m;
+              else if (v <= -m)
+                v += m;
+            }
+        }
+      else
+        v = fmodf (x, m);
+      OUT = v;
+    }
+  ALIGNED_ARGS_SILENCE;
 }
 
 /**********************************************************************/
@@ -157,6 +246,202 @@ static inline void op_noise (OP_ARGS)
 
 /**********************************************************************/
 
+/* One operator of an FM stack, equivalent to
+ *   wave (hz * ratio + modulation + feedback * previous) * level * envelope
+ * where wave is one of the oscillator ops, but without the chunks for the
+ * intermediate results. The phase and waveforms are computed like in the
+ * oscillator ops, including the use of the advanced phase by some of the
+ * OPL waveforms.
+ */
+static inline float sine (float a); /* in lyd-vm.c */
+
+/* expands LOOP for the waveform selected by waveform, with OPL numbering,
+ * the waves are computed from the phase before (old) and after (new) the
+ * sample like the oscillator ops do */
+#define OPL_WAVEFORMS(LOOP) \
+  switch (waveform) \
+    { \
+      default: \
+      case 0: LOOP(sine (old * M_PI * 2)); break; \
+      case 1: LOOP(old < 0.5 ? sine (new * M_PI * 2) : 0.0); break; \
+      case 2: LOOP(fabsf (sine (old * M_PI * 2))); break; \
+      case 3: LOOP(fmodf (old, 0.5) < 0.25 ? \
+                   fabsf (sine (new * M_PI * 2)) : 0.0); break; \
+      case 4: LOOP(old < 0.5 ? sine (2 * new * M_PI * 2) : 0.0); break; \
+      case 5: LOOP(old < 0.5 ? fabs (sine (2 * new * M_PI * 2)) : 0.0); \
+              break; \
+      case 6: LOOP(old > 0.5 ? 1.0 : -1.0); break; \
+      case 7: LOOP(old * 2 - 1.0); break; \
+    }
+
+#define FM_LOOP(WAVE, FEEDBACK) \
+  for (i = 0; i < samples; i++) \
+    { \
+      float old = phase; \
+      float new = old + (arg0->v[i] * arg1->v[i] + arg2->v[i] FEEDBACK) * \
+                        vm->i_sample_rate; \
+      int   newi = new; \
+      float wave; \
+      new -= newi; \
+      phase = new; \
+      wave = WAVE; \
+      previous = wave; \
+      out->v[i] = wave * arg3->v[i] * arg4->v[i]; \
+    }
+
+/* without feedback the samples do not depend on each other's waves */
+#define FM_LOOP_FEEDBACK(WAVE) FM_LOOP(WAVE, + feedback * previous)
+#define FM_LOOP_PLAIN(WAVE)    FM_LOOP(WAVE, )
+
+static inline void op_fm (OP_ARGS)
+{
+  int   waveform = state->arg[5][0];
+  float feedback = state->arg[6][0];
+  float phase = state->phase;
+  float previous = 0.0;
+  int   i;
+  ALIGNED_ARGS;
+
+  if (feedback != 0.0)
+    {
+      if (!DATA)
+        DATA = g_new0 (float, 1);
+      previous = *(float*)DATA;
+      OPL_WAVEFORMS(FM_LOOP_FEEDBACK);
+    }
+  else
+    OPL_WAVEFORMS(FM_LOOP_PLAIN);
+
+  state->phase = phase;
+  if (DATA)
+    *(float*)DATA = previous;
+  ALIGNED_ARGS_SILENCE;
+}
+
+/* Several copies of an oscillator detuned from each other and mixed, like
+ * mix (sin (hz * 0.99), sin (hz), sin (hz * 1.01)). The copies are
+ * advanced side by side for each sample, their phases do not depend on
+ * each other which lets them be computed in parallel.
+ */
+#define UNISON_LOOP(WAVE) \
+  for (i = 0; i < samples; i++) \
+    { \
+      float sum = 0.0; \
+      for (v = 0; v < voices; v++) \
+        { \
+          float old = phases[v]; \
+          float new = old + arg0->v[i] * step[v]; \
+          int   newi = new; \
+          new -= newi; \
+          phases[v] = new; \
+          sum += WAVE; \
+        } \
+      out->v[i] = sum * gain; \
+    }
+
+static inline void op_unison (OP_ARGS)
+{
+  int    voices   = state->arg[1][0];
+  float  detune   = state->arg[2][0];
+  int    waveform = state->arg[3][0];
+  float  phases[LYD_MAX_UNISON];
+  float  step[LYD_MAX_UNISON];
+  float  gain;
+  int    i, v;
+  ALIGNED_ARGS;
+
+  if (voices < 1)
+    voices = 1;
+  if (voices > LYD_MAX_UNISON)
+    voices = LYD_MAX_UNISON;
+  if (!DATA)
+    DATA = g_new0 (float, LYD_MAX_UNISON);
+  memcpy (phases, DATA, sizeof (float) * voices);
+  gain = 1.0 / voices;
+
+  /* spread evenly from hz * (1 - detune) to hz * (1 + detune) */
+  for (v = 0; v < voices; v++)
+    step[v] = (voices > 1 ? 1.0 - detune + 2 * detune * v / (voices - 1)
+                          : 1.0) * vm->i_sample_rate;
+
+  OPL_WAVEFORMS(UNISON_LOOP);
+
+  memcpy (DATA, phases, sizeof (float) * voices);
+  ALIGNED_ARGS_SILENCE;
+}
+
+/* Sum of sine partials at ratios of hz, from a table of ratio and amplitude
+ * pairs. Each partial is a rotating vector, advancing it a sample is a
+ * multiply by a rotation matrix instead of a sinf (). The vectors are set
+ * from the phases with sinf () and cosf () at the start of every chunk, so
+ * rounding errors do not build up. Partials are done ADDITIVE_LANES at a
+ * time, the lanes do not depend on each other and are vectorized.
+ */
+#define ADDITIVE_LANES 8
+
+static inline void op_additive (OP_ARGS)
+{
+  int      no = state->arg[1][0];
+  LydWave *table = no >= 0 && no < LYD_MAX_WAVE ? vm->lyd->wave[no] : NULL;
+  float   *phases;
+  float    hz;
+  int      partials, k, l, i;
+  ALIGNED_ARGS;
+
+  for (i = 0; i < samples; i++)
+    OUT = 0.0;
+  if (!table)
+    return;
+  partials = table->samples / 2;
+  if (partials > LYD_MAX_PARTIALS)
+    partials = LYD_MAX_PARTIALS;
+  if (!DATA)
+    DATA = g_new0 (float, LYD_MAX_PARTIALS);
+  phases = DATA;
+  hz = ARG0(0);
+
+  for (k = 0; k < partials; k += ADDITIVE_LANES)
+    {
+      float s[ADDITIVE_LANES], c[ADDITIVE_LANES];   /* amplitude scaled */
+      float rs[ADDITIVE_LANES], rc[ADDITIVE_LANES]; /* rotation per sample */
+
+      for (l = 0; l < ADDITIVE_LANES; l++)
+        {
+          int   n = k + l;
+          float amplitude = n < partials ? table->data[n * 2 + 1] : 0.0;
+          float step = n < partials ? hz * table->data[n * 2] *
+                                      vm->i_sample_rate : 0.0;
+          float phase = phases[n];
+
+          if (fabsf (step) >= 0.5) /* at or above nyquist */
+            amplitude = step = 0.0;
+          s[l]  = amplitude * sinf (phase * M_PI * 2);
+          c[l]  = amplitude * cosf (phase * M_PI * 2);
+          rs[l] = sinf (step * M_PI * 2);
+          rc[l] = cosf (step * M_PI * 2);
+
+          phase += step * samples;
+          phases[n] = phase - floorf (phase);
+        }
+
+      for (i = 0; i < samples; i++)
+        {
+          float sum = 0.0;
+          for (l = 0; l < ADDITIVE_LANES; l++)
+            {
+              float t = s[l] * rc[l] + c[l] * rs[l];
+              sum += s[l];
+              c[l] = c[l] * rc[l] - s[l] * rs[l];
+              s[l] = t;
+            }
+          OUT += sum;
+        }
+    }
+  ALIGNED_ARGS_SILENCE;
+}
+
+/**********************************************************************/
+
 static inline float input_sample_peek (LydVM *vm,
                                        int    no)
 {
@@ -183,6 +468,27 @@ static inline float input_sample (LydVM *vm,
   return ret;
 }
 
+static inline void op_global (OP_ARGS)
+{
+  Lyd       *lyd = vm->lyd;
+  int        no  = state->arg[0][0];
+  LydGlobal *global = no < lyd->global_count ? lyd->global[no] : NULL;
+
+  if (global && vm->pending_globals)
+    {
+      if (vm->period_pos + samples <= global->pending_samples)
+        memcpy (state->out, global->pending + vm->period_pos,
+                sizeof (LydSample) * samples);
+      else
+        memset (state->out, 0, sizeof (LydSample) * samples);
+    }
+  else if (global && vm->period_pos + samples <= global->samples)
+    memcpy (state->out, global->buf + vm->period_pos,
+            sizeof (LydSample) * samples);
+  else
+    memset (state->out, 0, sizeof (LydSample) * samples);
+}
+
 static inline void op_inputp (OP_ARGS)
 {
   OP_LOOP(OUT = input_sample_peek (vm, ARG0(0));)
@@ -238,86 +544,388 @@ static inline void op_wave_loop (OP_ARGS)
 
 /**********************************************************************/
 
-static inline void op_mix (OP_ARGS)
+/* waveshaper, maps x from -1.0 to 1.0 over the table */
+static inline void op_shape (OP_ARGS)
 {
-  int i;
+  int      no   = state->arg[0][0];
+  LydWave *wave = no >= 0 && no < LYD_MAX_WAVE ? vm->lyd->wave[no] : NULL;
+  float   *d;
+  float    scale, last;
+  int      i;
   ALIGNED_ARGS;
-  switch (state->argc)
+
+  if (!wave || wave->samples < 2)
+    {
+      for (i = 0; i < samples; i++)
+        OUT = wave ? wave->data[0] : 0.0;
+      return;
+    }
+  d = wave->data;
+  last = wave->samples - 1;
+  scale = last * 0.5;
+  for (i = 0; i < samples; i++)
     {
-      case 0: for (i = 0; i < samples; i++)
-         OUT = 0; break;
-      case 1: for (i = 0; i < samples; i++)
-         OUT = ARG(0); break;
-      case 2: for (i = 0; i < samples; i++)
-         OUT = (ARG(0) + ARG(1))/2; break;
-      case 3: for (i = 0; i < samples; i++)
-         OUT = (ARG(0) + ARG(1) + ARG(2))/3; break;
-      case 4: for (i = 0; i < samples; i++)
-         OUT = (ARG(0) + ARG(1) + ARG(2) + ARG(3))/4; break;
-      case 5: for (i = 0; i < samples; i++)
-         OUT = (ARG(0) + ARG(1) + ARG(2) + ARG(3) +
-                ARG(4))/5; break;
-      case 6: for (i = 0; i < samples; i++)
-         OUT = (ARG(0) + ARG(1) + ARG(2) + ARG(3) +
-                ARG(4) + ARG(5))/6; break;
-      case 7: for (i = 0; i < samples; i++)
-         OUT = (ARG(0) + ARG(1) + ARG(2) + ARG(3) +
-                ARG(4) + ARG(5) + ARG(6))/7; break;
-      case 8: for (i = 0; i < samples; i++)
-         OUT = (ARG(0) + ARG(1) + ARG(2) + ARG(3) +
-                ARG(4) + ARG(5) + ARG(6) + ARG(7))/8; break;
+      float p = (ARG(1) + 1.0) * scale;
+      int   j;
+      if (p < 0.0)
+        p = 0.0;
+      if (p > last)
+        p = last;
+      j = p;
+      if (j == wave->samples - 1)
+        j--;
+      OUT = d[j] + (d[j + 1] - d[j]) * (p - j);
     }
   ALIGNED_ARGS_SILENCE;
 }
 
+/* cubic hermite interpolation in a periodic table of n >= 2 values */
+static inline float table_cubic (const float *d, int n, float pos)
+{
+  int   j  = pos;
+  float t  = pos - j;
+  float y0 = d[j > 0 ? j - 1 : n - 1];
+  float y1 = d[j];
+  float y2 = d[j + 1 < n ? j + 1 : j + 1 - n];
+  float y3 = d[j + 2 < n ? j + 2 : j + 2 - n];
+  float c1 = 0.5 * (y2 - y0);
+  float c2 = y0 - 2.5 * y1 + 2 * y2 - 0.5 * y3;
+  float c3 = 0.5 * (y3 - y0) + 1.5 * (y1 - y2);
+  return ((c3 * t + c2) * t + c1) * t + y1;
+}
 
-/**********************************************************************/
+static inline float phase (LydVM *vm, LydOpState *state, float hz);
 
-typedef struct _EchoData
+/* oscillator playing single cycle frames of LYD_WAVETABLE_FRAME samples
+ * from a table, position crossfades between neighbouring frames */
+static inline void op_wavetable (OP_ARGS)
 {
-   int    pos;
-   int    size;
-   LydSample *old;
-} EchoData;
+  int      no   = state->arg[0][0];
+  LydWave *wave = no >= 0 && no < LYD_MAX_WAVE ? vm->lyd->wave[no] : NULL;
+  int      frame, frames, i;
+  ALIGNED_ARGS;
 
-static inline void op_echo (OP_ARGS)
+  if (!wave || wave->samples < 2)
+    {
+      for (i = 0; i < samples; i++)
+        OUT = 0.0;
+      return;
+    }
+  frame = wave->samples < LYD_WAVETABLE_FRAME ? wave->samples
+                                              : LYD_WAVETABLE_FRAME;
+  frames = wave->samples / frame;
+
+  for (i = 0; i < samples; i++)
+    {
+      float p = phase (vm, state, ARG(1));
+      float f = ARG(2) * (frames - 1);
+      int   a;
+      float v;
+
+      if (p < 0.0)
+        p += 1.0;
+      p *= frame;
+      if (p >= frame)
+        p = 0.0;
+      if (f < 0.0)
+        f = 0.0;
+      if (f > frames - 1)
+        f = frames - 1;
+      a = f;
+      v = table_cubic (wave->data + a * frame, frame, p);
+      if (a < frames - 1)
+        v += (table_cubic (wave->data + (a + 1) * frame, frame, p) - v) *
+             (f - a);
+      OUT = v;
+    }
+  ALIGNED_ARGS_SILENCE;
+}
+
+/**********************************************************************/
+
+typedef struct _Grain
 {
-  EchoData *data   = state->data;
-  int i;
+  int   start;       /* first sample of the chunk it plays in */
+  float pos;         /* in the wave, in samples */
+  float step;
+  float window;      /* 0.0 - 1.0 over the length of the grain */
+  float window_step;
+} Grain;
+
+typedef struct _GrainsData
+{
+  float next;        /* reaches 1.0 when the next grain starts */
+  int   count;
+  Grain grain[LYD_MAX_GRAINS];
+} GrainsData;
+
+/* Granular synthesis, short windowed snippets of a wave started density
+ * times a second, all overlapping grains are mixed in the op. The
+ * parameters are read when a grain starts, a grain then plays with fixed
+ * rate and window.
+ */
+static inline void op_grains (OP_ARGS)
+{
+  int         no   = state->arg[0][0];
+  LydWave    *wave = no >= 0 && no < LYD_MAX_WAVE ? vm->lyd->wave[no] : NULL;
+  GrainsData *data = state->data;
+  int         g, i;
   ALIGNED_ARGS;
-  for (i=0; i<samples; i++)
+
+  for (i = 0; i < samples; i++)
+    OUT = 0.0;
+  if (!wave || wave->samples < 2)
+    return;
+  if (!data)
+    data = state->data = g_new0 (GrainsData, 1);
+
+  for (i = 0; i < samples; i++)
     {
-      LydSample   strength = ARG(0),
-                  length = ARG(1),
-                  sample = ARG(2);
-      int         size   = length * vm->sample_rate;
+      data->next += ARG(1) * vm->i_sample_rate;
+      if (data->next >= 1.0)
+        {
+          Grain *grain = &data->grain[data->count];
+          float  length = ARG(5) > 0.0 ? ARG(5) : 0.05;
+          float  pitch  = ARG(3) != 0.0 ? ARG(3) : 1.0;
+
+          data->next -= (int)data->next;
+          if (data->count == LYD_MAX_GRAINS)
+            continue;
+          data->count++;
+
+          pitch *= 1.0 + ARG(4) * 2 * noise ();
+          grain->start = i;
+          grain->pos = (ARG(2) + ARG(6) * 2 * noise ()) * wave->samples;
+          grain->step = pitch * wave->sample_rate * vm->i_sample_rate;
+          grain->window = 0.0;
+          grain->window_step = vm->i_sample_rate / length;
+        }
+    }
+
+  for (g = 0; g < data->count; g++)
+    {
+      Grain *grain  = &data->grain[g];
+      float  pos    = grain->pos;
+      float  window = grain->window;
+      int    end    = samples;
+
+      /* stop where the window closes */
+      if (window + grain->window_step * (samples - grain->start) > 1.0)
+        end = grain->start + (1.0 - window) / grain->window_step;
+      if (end > samples)
+        end = samples;
+
+      for (i = grain->start; i < end; i++)
+        {
+          int   j = pos;
+          float w = 4 * window * (1.0 - window); /* bell, (4t(1-t))^2 */
+
+          if (j >= 0 && j < wave->samples - 1)
+            OUT += (wave->data[j] + (wave->data[j + 1] - wave->data[j]) *
+                                    (pos - j)) * w * w;
+          pos += grain->step;
+          window += grain->window_step;
+        }
+
+      if (end < samples)
+        { /* finished, the last grain takes its place */
+          data->grain[g--] = data->grain[--data->count];
+          continue;
+        }
+      grain->start = 0;
+      grain->pos = pos;
+      grain->window = window;
+    }
+  ALIGNED_ARGS_SILENCE;
+}
 
-      if (size <=0)
-        return;
+/**********************************************************************/
 
-      if (G_UNLIKELY (size > LYD_MAX_REVERB_SIZE))
-        size = LYD_MAX_REVERB_SIZE;
+/* out = (in[0] + .. + in[n-1]) * scale, accumulated four inputs at a time
+ * so that out stays in cache and each input is read once */
+static inline void sum_inputs (LydSample *__restrict__ out, LydSample **in,
+                               int n, float scale, int samples)
+{
+  int i, j;
+
+  for (j = 0; j < n || j == 0; j += 4)
+    {
+      LydSample * __restrict__ a = j     < n ? in[j]     : NULL;
+      LydSample * __restrict__ b = j + 1 < n ? in[j + 1] : NULL;
+      LydSample * __restrict__ c = j + 2 < n ? in[j + 2] : NULL;
+      LydSample * __restrict__ d = j + 3 < n ? in[j + 3] : NULL;
 
-      if (G_UNLIKELY (data == NULL ||
-          size != data->size))
+      switch ((j ? 4 : 0) + (n - j < 4 ? n - j : 4))
         {
-          data = state->data = g_malloc0 (sizeof (LydSample) *size + sizeof(EchoData));
-          data->size = size;
-          data->old = after_ptr (data, EchoData);
+          case 0:
+            for (i = 0; i < samples; i++)
+              out[i] = 0.0;
+            break;
+          case 1:
+            for (i = 0; i < samples; i++)
+              out[i] = a[i];
+            break;
+          case 2:
+            for (i = 0; i < samples; i++)
+              out[i] = a[i] + b[i];
+            break;
+          case 3:
+            for (i = 0; i < samples; i++)
+              out[i] = a[i] + b[i] + c[i];
+            break;
+          case 4:
+            for (i = 0; i < samples; i++)
+              out[i] = a[i] + b[i] + c[i] + d[i];
+            break;
+          case 5:
+            for (i = 0; i < samples; i++)
+              out[i] += a[i];
+            break;
+          case 6:
+            for (i = 0; i < samples; i++)
+              out[i] += a[i] + b[i];
+            break;
+          case 7:
+            for (i = 0; i < samples; i++)
+              out[i] += a[i] + b[i] + c[i];
+            break;
+          case 8:
+            for (i = 0; i < samples; i++)
+              out[i] += a[i] + b[i] + c[i] + d[i];
+            break;
         }
+    }
+  if (scale != 1.0)
+    for (i = 0; i < samples; i++)
+      out[i] *= scale;
+}
 
-      sample = sample + data->old[data->pos] * strength;
-      data->old[data->pos++] = sample / (1.0 + strength);
-      if (G_UNLIKELY (data->pos >= size))
-        data->pos = 0;
+static inline void op_mix (OP_ARGS)
+{
+  sum_inputs (state->out, state->arg, state->argc,
+              state->argc ? 1.0 / state->argc : 1.0, samples);
+}
+
+static inline void op_sum (OP_ARGS)
+{
+  sum_inputs (state->out, state->arg, state->argc, 1.0, samples);
+}
+
+/**********************************************************************/
+
+/* The delay family keeps its history in a power of two ring, pos counts
+ * the samples written and is wrapped with mask on access. There is room
+ * for a chunk beyond the longest delay, so a chunk can be written before
+ * the delayed samples are read back.
+ */
+
+#define MAX_DELAY_SIZE   (48000 * 200)
+
+typedef struct _DelayData
+{
+   unsigned int pos;
+   unsigned int mask;
+   LydSample   *ring;
+   int         *tap;  /* delays of the taps of the tapped ops, in samples */
+} DelayData;
+
+/* get the ring of state, (re)allocated to fit delays of size samples */
+static inline DelayData *delay_data (LydVM *vm, LydOpState *state, int size)
+{
+  DelayData   *data = state->data;
+  DelayData   *old  = data;
+  unsigned int n, k;
+
+  if (data && size + LYD_CHUNK <= data->mask + 1)
+    return data;
+
+  for (n = LYD_CHUNK; n < size + LYD_CHUNK; n *= 2);
+  data = lyd_mem_alloc (vm->lyd, sizeof (DelayData) + sizeof (LydSample) * n +
+                              sizeof (int) * state->argc);
+  data->mask = n - 1;
+  data->ring = after_ptr (data, DelayData);
+  data->tap = (int *)(data->ring + n);
+  if (old) /* growing, keep the history */
+    {
+      data->pos = old->pos;
+      for (k = 1; k <= old->mask + 1; k++)
+        data->ring[(data->pos - k) & data->mask] =
+          old->ring[(old->pos - k) & old->mask];
+      lyd_mem_free (vm->lyd, old);
+    }
+  state->data = data;
+  return data;
+}
+
+/* store samples at pos */
+static inline void ring_write (DelayData *data, LydSample *src, int samples)
+{
+  unsigned int at    = data->pos & data->mask;
+  int          first = data->mask + 1 - at;
+  if (first > samples)
+    first = samples;
+  memcpy (data->ring + at, src, sizeof (LydSample) * first);
+  memcpy (data->ring, src + first, sizeof (LydSample) * (samples - first));
+}
+
+/* read the samples stored delay samples before pos */
+static inline void ring_read (DelayData *data, int delay,
+                              LydSample *dst, int samples)
+{
+  unsigned int at    = (data->pos - delay) & data->mask;
+  int          first = data->mask + 1 - at;
+  if (first > samples)
+    first = samples;
+  memcpy (dst, data->ring + at, sizeof (LydSample) * first);
+  memcpy (dst + first, data->ring, sizeof (LydSample) * (samples - first));
+}
+
+/* add the samples stored delay samples before pos to dst */
+static inline void ring_add (DelayData *data, int delay,
+                             LydSample * __restrict__ dst, int samples)
+{
+  LydSample * __restrict__ ring = data->ring;
+  unsigned int at    = (data->pos - delay) & data->mask;
+  int          first = data->mask + 1 - at;
+  int i;
+  if (first > samples)
+    first = samples;
+  for (i = 0; i < first; i++)
+    dst[i] += ring[at + i];
+  for (; i < samples; i++)
+    dst[i] += ring[i - first];
+}
+
+/**********************************************************************/
+
+static inline void op_echo (OP_ARGS)
+{
+  int        size = state->arg[1][0] * vm->sample_rate;
+  DelayData *data;
+  int i;
+  ALIGNED_ARGS;
+
+  if (size <= 0)
+    return;
+  if (G_UNLIKELY (size > LYD_MAX_REVERB_SIZE))
+    size = LYD_MAX_REVERB_SIZE;
+  data = delay_data (vm, state, size);
+
+  for (i=0; i<samples; i++)
+    {
+      LydSample strength = ARG(0),
+                sample   = ARG(2);
+
+      sample = sample + data->ring[(data->pos - size) & data->mask] * strength;
+      data->ring[data->pos++ & data->mask] = sample / (1.0 + strength);
       OUT = sample;
     }
   ALIGNED_ARGS_SILENCE;
 }
 
-static inline void op_free (LydOpState *state)
+static inline void op_free (LydVM *vm, LydOpState *state)
 {
-  g_free (state->data);
+  lyd_mem_free (vm->lyd, state->data);
 }
 
 /**********************************************************************/
@@ -331,61 +939,82 @@ typedef struct _PluckData
    LydSample *old;
 } PluckData;
 
-/* Karplus Strong plucked string, implements the decaying of harmonics
- * similar to a plucked string.
+/* One Karplus Strong string at hz, its samples times gain are written to
+ * out, or added to it when accumulate is set. The string is excited by
+ * excite, or noise when it is NULL, and decays when decays is set.
  */
-static inline void op_pluck (OP_ARGS)
+static inline void pluck_string (LydVM      *vm,
+                                 PluckData **string,
+                                 float       hz,
+                                 float       decay,
+                                 int         decays,
+                                 LydChunk   *excite,
+                                 LydChunk   *out,
+                                 float       gain,
+                                 int         accumulate,
+                                 int         samples)
 {
-  PluckData *data   = state->data;
-  ALIGNED_ARGS;
-  int i = 0;
-  
-  for (i=0; i<samples; i++)
-    {
-      int         size   = (vm->sample_rate / ARG0(0));
-      int         p2;
-
-      if (size <=0)
-        return;
-
-      if (G_UNLIKELY (size > LYD_MAX_REVERB_SIZE))
-        size = LYD_MAX_REVERB_SIZE;
-
-      if (G_UNLIKELY (data == NULL ||
-          size > data->asize))
+  PluckData *data = *string;
+  int        size = vm->sample_rate / hz;
+  int        i;
+
+  if (size <= 0)
+    return;
+
+  if (G_UNLIKELY (size > LYD_MAX_REVERB_SIZE))
+    size = LYD_MAX_REVERB_SIZE;
+
+  if (G_UNLIKELY (data == NULL ||
+      size > data->asize))
+    { /* room for the string rounded up to a power of two, keeping
+         what is already in it when the pitch drops */
+      PluckData *old = data;
+      int asize;
+      for (asize = LYD_CHUNK; asize < size; asize *= 2);
+      data = *string = lyd_mem_alloc (vm->lyd, sizeof (LydSample) * asize + sizeof(PluckData));
+      data->asize = asize;
+      data->size = size;
+      data->old = after_ptr (data, PluckData);
+
+      if (old)
         {
-          int asize = size;
-          if (asize < vm->sample_rate * 1.0)
-            asize = vm->sample_rate * 1.0;
-          if (state->data)
-            g_free (state->data);
-          data = state->data = g_malloc0 (sizeof (LydSample) * asize + sizeof(PluckData));
-          data->asize = asize;
-          data->size = size;
-          data->old = after_ptr (data, PluckData);
-
-          data->decay_ratio = ARG0(1);
+          data->pos = old->pos;
+          data->decay_ratio = old->decay_ratio;
+          memcpy (data->old, old->old, sizeof (LydSample) * old->asize);
+          lyd_mem_free (vm->lyd, old);
+        }
+      else
+        {
+          data->decay_ratio = decay;
           if (data->decay_ratio != 0.0)
             data->decay_ratio = 1.0/data->decay_ratio;
         }
+    }
+
+  for (i=0; i<samples; i++)
+    {
+      int p2;
 
       /* varying the generated original wave varies the type of pluck..
        */
       if (SAMPLE < size)
         {
-          if (state->argc > 2)
-            data->old[data->pos] = ARG(2);
+          if (excite)
+            data->old[data->pos] = excite->v[i];
           else
             data->old[data->pos] = noise () * 2;
         }
 
-      OUT = data->old[data->pos];
+      if (accumulate)
+        out->v[i] += data->old[data->pos] * gain;
+      else
+        out->v[i] = data->old[data->pos];
       p2 = data->pos;
       p2--;
       if (p2 <0)
         p2 += size;
 
-      if (state->argc < 2 ||
+      if (!decays ||
           data->decay_ratio > (noise() + 0.5))
         data->old[data->pos] = (data->old[data->pos] + data->old[p2])/2.00;
 
@@ -393,219 +1022,309 @@ static inline void op_pluck (OP_ARGS)
       if (G_UNLIKELY (data->pos >= size))
         data->pos -= size;
     }
-  ALIGNED_ARGS_SILENCE;
 }
 
-/**********************************************************************/
-
-#define MAX_DELAY_SIZE   (48000 * 200)
-
-typedef struct _DelayData
+/* Karplus Strong plucked string, implements the decaying of harmonics
+ * similar to a plucked string.
+ */
+static inline void op_pluck (OP_ARGS)
 {
-   int    pos;
-   int    size;
-   int    asize;
-   LydSample *old;
-} DelayData;
+  ALIGNED_ARGS;
+  pluck_string (vm, (PluckData **)&state->data, ARG0(0), ARG0(1),
+                state->argc >= 2, state->argc > 2 ? arg2 : NULL,
+                out, 1.0, 0, samples);
+  ALIGNED_ARGS_SILENCE;
+}
 
-static inline void op_delay (OP_ARGS)
+/* detuned plucked strings mixed, the unison counterpart of pluck */
+static inline void op_pluck_unison (OP_ARGS)
 {
-  /* XXX: allow dynamically changing the length */
-  DelayData *data   = state->data;
-  int i;
+  PluckData **strings;
+  int         voices = state->arg[1][0];
+  float       detune = state->arg[2][0];
+  int         i, v;
   ALIGNED_ARGS;
-  for (i=0; i<samples; i++)
-    {
-      LydSample length = ARG(0),
-                sample = ARG(1);
-      int       size   = length * vm->sample_rate;
 
-      if (size <=0)
-        return;
+  if (voices < 1)
+    voices = 1;
+  if (voices > LYD_MAX_UNISON)
+    voices = LYD_MAX_UNISON;
+  if (!DATA)
+    DATA = g_new0 (PluckData *, LYD_MAX_UNISON);
+  strings = DATA;
 
-      if (G_UNLIKELY (size > MAX_DELAY_SIZE))
-        size = MAX_DELAY_SIZE;
-
-      if (G_UNLIKELY (data == NULL ||
-          size > data->asize))
-        {
-          int asize = size;
-          if (asize < vm->sample_rate * 1.0)
-            asize = vm->sample_rate * 1.0;
-          if (state->data)
-            g_free (state->data);
-          data = state->data = g_malloc0 (sizeof (LydSample) * asize + sizeof(DelayData));
-          data->asize = asize;
-          data->size = size;
-          data->old = after_ptr (data, DelayData);
-        }
-
-      OUT = data->old[data->pos];
-      data->old[data->pos] = sample;
-      data->pos ++;
-      if (G_UNLIKELY (data->pos >= size))
-        data->pos = 0;
+  for (i = 0; i < samples; i++)
+    OUT = 0.0;
+  for (v = 0; v < voices; v++)
+    {
+      float ratio = voices > 1 ? 1.0 - detune + 2 * detune * v / (voices - 1)
+                               : 1.0;
+      pluck_string (vm, &strings[v], ARG0(0) * ratio, ARG0(3),
+                    state->argc >= 4, state->argc > 4 ? arg4 : NULL,
+                    out, 1.0 / voices, 1, samples);
     }
   ALIGNED_ARGS_SILENCE;
 }
 
-/**********************************************************************/
-
-typedef struct _TappedDelayData
+static void op_pluck_unison_free (LydVM *vm, LydOpState *state)
 {
-   int    pos;
-   int    size;
-   int    asize;
-   int    taps[8];
-   LydSample *old;
-} TappedDelayData;
+  PluckData **strings = state->data;
+  int         v;
+  for (v = 0; v < LYD_MAX_UNISON; v++)
+    if (strings[v])
+      lyd_mem_free (vm->lyd, strings[v]);
+  g_free (strings);
+}
 
+/**********************************************************************/
 
-static inline void op_tapped_delay (OP_ARGS) /* XXX: should perhaps have the data as last arg? */
+static inline void op_delay (OP_ARGS)
 {
-  /* XXX: allow dynamically changing the length */
-  TappedDelayData *data   = state->data;
-  int i;
-  ALIGNED_ARGS;
-  for (i=0; i<samples; i++)
+  LydSample *in   = state->arg[1];
+  int        size = state->arg[0][0] * vm->sample_rate;
+  DelayData *data;
+
+  if (size <= 0)
     {
-      LydSample sample = ARG(0),
-                length[8];
-      float     max_length=0.0;
-      LydSample result = 0.0;
-      int       size;
+      memcpy (state->out, in, sizeof (LydSample) * samples);
+      return;
+    }
+  if (G_UNLIKELY (size > MAX_DELAY_SIZE))
+    size = MAX_DELAY_SIZE;
 
-      int j;
-      if (state->argc > 1) {length[0] = ARG(1);
-      if (state->argc > 2) {length[1] = ARG(2);
-      if (state->argc > 3) {length[2] = ARG(3);
-      if (state->argc > 4) {length[3] = ARG(4);
-      if (state->argc > 5) {length[4] = ARG(5);
-      if (state->argc > 6) {length[5] = ARG(6);
-      if (state->argc > 7) {length[6] = ARG(7);}}}}}}}
+  data = delay_data (vm, state, size);
+  ring_write (data, in, samples);
+  ring_read (data, size, state->out, samples);
+  data->pos += samples;
+}
 
-      for (j = 0; j < state->argc-1; j++)
-          if (length[j] > max_length)
-            max_length = length[j];
+/**********************************************************************/
 
-      size = max_length * vm->sample_rate;
+/* the ring of a tapped op with the delays of its taps filled in, in
+ * samples relative to the longest tap; NULL when all taps are 0 */
+static inline DelayData *delay_taps (LydVM *vm, LydOpState *state, int extra)
+{
+  float      max_length = 0.0;
+  int        taps = state->argc - 1;
+  int        size;
+  int        j;
+  DelayData *data;
+
+  for (j = 0; j < taps; j++)
+    if (state->arg[j+1][0] > max_length)
+      max_length = state->arg[j+1][0];
+
+  size = max_length * vm->sample_rate;
+  if (size <= 0)
+    return NULL;
+  if (G_UNLIKELY (size > MAX_DELAY_SIZE))
+    size = MAX_DELAY_SIZE;
+
+  data = delay_data (vm, state, size);
+  for (j = 0; j < taps; j++)
+    {
+      data->tap[j] = size - (int)((max_length - state->arg[j+1][0]) *
+                                  vm->sample_rate) - extra;
+      while (data->tap[j] <= 0)
+        data->tap[j] += size;
+    }
+  return data;
+}
 
-      if (size <=0)
-        return;
+static inline void op_tapped_delay (OP_ARGS) /* XXX: should perhaps have the data as last arg? */
+{
+  LydSample * __restrict__ out = state->out;
+  LydSample *in = state->arg[0];
+  DelayData *data = delay_taps (vm, state, 1);
+  int        taps = state->argc - 1;
+  int i, j;
 
-      if (G_UNLIKELY (size > MAX_DELAY_SIZE))
-        size = MAX_DELAY_SIZE;
+  if (!data)
+    {
+      memcpy (out, in, sizeof (LydSample) * samples);
+      return;
+    }
 
-      if (G_UNLIKELY (data == NULL ||
-          size > data->asize))
-        {
-          int asize = size;
-          if (asize < vm->sample_rate * 1.0)
-            asize = vm->sample_rate * 1.0;
-          if (state->data)
-            g_free (state->data);
-          data = state->data = g_malloc0 (sizeof (LydSample) * asize + sizeof(TappedDelayData));
-          data->asize = asize;
-
-          data->size = size;
-          data->old = after_ptr (data, TappedDelayData);
-        }
+  ring_write (data, in, samples);
+  for (i = 0; i < samples; i++)
+    out[i] = 0.0;
+  for (j = 0; j < taps; j++)
+    ring_add (data, data->tap[j], out, samples);
+  for (i = 0; i < samples; i++)
+    out[i] /= taps;
+  data->pos += samples;
+}
 
-      for (j = 0; j < state->argc-1; j++)
-        {
-          int tappos = data->pos + (max_length - length[j]) * vm->sample_rate + 1;
-          while (tappos >= size)
-            tappos -= size;
-          result += data->old[tappos];
-        }
-      result /= (state->argc-1);
+/**********************************************************************/
 
-      OUT = result;
-      data->old[data->pos] = sample;
-      data->pos ++;
-      if (data->pos >= size)
-        data->pos = 0;
+static inline void op_tapped_echo (OP_ARGS)
+{
+  LydSample * __restrict__ out = state->out;
+  LydSample *in = state->arg[0];
+  DelayData *data = delay_taps (vm, state, 0);
+  int        taps = state->argc - 1;
+  int       *delay;
+  int        min_delay;
+  int i, j;
+
+  if (!data)
+    return;
+
+  delay = data->tap;
+  min_delay = delay[0];
+  for (j = 1; j < taps; j++)
+    if (delay[j] < min_delay)
+      min_delay = delay[j];
+
+  if (min_delay >= samples) /* no feedback within the chunk */
+    {
+      for (i = 0; i < samples; i++)
+        out[i] = 0.0;
+      for (j = 0; j < taps; j++)
+        ring_add (data, delay[j], out, samples);
+      for (i = 0; i < samples; i++)
+        out[i] = in[i] + (out[i] / taps) * 0.9;
+      ring_write (data, out, samples);
+      data->pos += samples;
+      return;
+    }
+
+  for (i = 0; i < samples; i++)
+    {
+      LydSample result = 0.0;
+      for (j = 0; j < taps; j++)
+        result += data->ring[(data->pos - delay[j]) & data->mask];
+      result /= taps;
+      out[i] = data->ring[data->pos++ & data->mask] = in[i] + result * 0.9;
     }
-  ALIGNED_ARGS_SILENCE;
 }
 
 /**********************************************************************/
 
-typedef struct _TappedEchoData
-{
-   int    pos;
-   int    size;
-   int    asize;
-   int    taps[8];
-   LydSample *old;
-} TappedEchoData;
+#include "fft.c"
 
+/* Uniformly partitioned convolution, the impulse response is cut in blocks
+ * of LYD_CHUNK samples whose spectra are computed when the wave is loaded.
+ * Each voice keeps the spectra of its recent input blocks in a frequency
+ * domain delay line, and per block multiplies and accumulates them with the
+ * impulse response spectra, followed by one inverse transform (overlap-save).
+ * Impulse responses are cut after LYD_CONVOLVE_PARTITIONS blocks, which
+ * bounds the delay line of each voice.
+ */
 
-static inline void op_tapped_echo (OP_ARGS)
+typedef struct _ConvolveData
 {
-  /* XXX: allow dynamically changing the length */
-  TappedEchoData *data   = state->data;
-  int i;
-  ALIGNED_ARGS;
-  for (i=0; i<samples; i++)
+   int        generation; /* of the wave the spectra were taken from */
+   int        partitions;
+   int        slot;       /* delay line slot of the newest input block */
+   int        fill;       /* samples in the current input block */
+   LydSample *in;         /* previous and current input block */
+   LydSample *out;        /* output for the current input block */
+   LydSample *fdl;        /* spectra of the last partitions input blocks */
+} ConvolveData;
+
+#define CONV_SPECTRUM  (FFT_STRIDE * 2)
+
+void lyd_wave_spectra (LydWave *wave)
+{
+  float block[FFT_SIZE];
+  int   partitions = (wave->samples + LYD_CHUNK - 1) / LYD_CHUNK;
+  int   p, i;
+
+  if (partitions > LYD_CONVOLVE_PARTITIONS)
+    partitions = LYD_CONVOLVE_PARTITIONS;
+  wave->spectra = g_malloc0 (sizeof (float) * CONV_SPECTRUM * partitions);
+  for (p = 0; p < partitions; p++)
     {
-      LydSample sample = ARG(0),
-                length[8];
-      float     max_length=0.0;
-      LydSample result = 0.0;
-      int       size;
+      float *spectrum = wave->spectra + p * CONV_SPECTRUM;
+      for (i = 0; i < FFT_SIZE; i++) /* scaled for the inverse transform */
+        block[i] = i < LYD_CHUNK && p * LYD_CHUNK + i < wave->samples ?
+                   wave->data[p * LYD_CHUNK + i] / FFT_SIZE : 0.0;
+      fft_forward (block, spectrum);
+    }
+  wave->partitions = partitions;
+}
 
-      int j;
-      if (state->argc > 1) {length[0] = ARG(1);
-      if (state->argc > 2) {length[1] = ARG(2);
-      if (state->argc > 3) {length[2] = ARG(3);
-      if (state->argc > 4) {length[3] = ARG(4);
-      if (state->argc > 5) {length[4] = ARG(5);
-      if (state->argc > 6) {length[5] = ARG(6);
-      if (state->argc > 7) {length[6] = ARG(7);}}}}}}}
+static void convolve_block (ConvolveData *data, const float *spectra)
+{
+  float acc[CONV_SPECTRUM] __attribute__ ((aligned (16)));
+  float result[FFT_SIZE];
+  int   p, k;
 
-      for (j = 0; j < state->argc-1; j++)
-          if (length[j] > max_length)
-            max_length = length[j];
+  fft_forward (data->in, data->fdl + data->slot * CONV_SPECTRUM);
+
+  for (k = 0; k < CONV_SPECTRUM; k++)
+    acc[k] = 0.0;
+  for (p = 0; p < data->partitions; p++)
+    {
+      int slot = data->slot - p;
+      const float * __restrict__ x;
+      const float * __restrict__ h = spectra + p * CONV_SPECTRUM;
+      if (slot < 0)
+        slot += data->partitions;
+      x = data->fdl + slot * CONV_SPECTRUM;
+      for (k = 0; k < FFT_BINS; k++)
+        {
+          acc[k]              += x[k] * h[k] -
+                                 x[FFT_STRIDE + k] * h[FFT_STRIDE + k];
+          acc[FFT_STRIDE + k] += x[k] * h[FFT_STRIDE + k] +
+                                 x[FFT_STRIDE + k] * h[k];
+        }
+    }
+  fft_inverse (acc, result);
 
-      size = max_length * vm->sample_rate;
+  memcpy (data->out, result + LYD_CHUNK, sizeof (LydSample) * LYD_CHUNK);
+  memcpy (data->in, data->in + LYD_CHUNK, sizeof (LydSample) * LYD_CHUNK);
+  if (++data->slot >= data->partitions)
+    data->slot = 0;
+}
 
-      if (size <=0)
-        return;
+static inline void op_convolve (OP_ARGS)
+{
+  ConvolveData *data = state->data;
+  int           no   = state->arg[0][0];
+  LydWave      *wave = no >= 0 && no < LYD_MAX_WAVE ? vm->lyd->wave[no] : NULL;
+  LydSample    *in   = state->arg[1];
+  int           done = 0;
 
-      if (G_UNLIKELY (size > MAX_DELAY_SIZE))
-        size = MAX_DELAY_SIZE;
+  if (G_UNLIKELY (!wave))
+    {
+      memset (state->out, 0, sizeof (LydSample) * samples);
+      return;
+    }
 
-      if (G_UNLIKELY (data == NULL ||
-          size > data->asize))
-        {
-          int asize = size;
-          if (asize < vm->sample_rate * 1.0)
-            asize = vm->sample_rate * 1.0;
-          if (state->data)
-            g_free (state->data);
-          data = state->data = g_malloc0 (sizeof (LydSample) * asize + sizeof(TappedEchoData));
-          data->asize = asize;
-
-          data->size = size;
-          data->old = after_ptr (data, TappedEchoData);
-        }
+  if (G_UNLIKELY (data == NULL || data->generation != wave->generation))
+    {
+      int partitions = wave->partitions;
+      if (data)
+        lyd_mem_free (vm->lyd, data);
+      data = state->data = lyd_mem_alloc (vm->lyd, sizeof (ConvolveData) +
+                 sizeof (LydSample) * (FFT_SIZE + LYD_CHUNK +
+                                       CONV_SPECTRUM * partitions));
+      data->generation = wave->generation;
+      data->partitions = partitions;
+      data->in = after_ptr (data, ConvolveData);
+      data->out = data->in + FFT_SIZE;
+      data->fdl = data->out + LYD_CHUNK;
+    }
 
-      for (j = 0; j < state->argc-1; j++)
+  while (done < samples)
+    {
+      int count = LYD_CHUNK - data->fill;
+      if (count > samples - done)
+        count = samples - done;
+      memcpy (state->out + done, data->out + data->fill,
+              sizeof (LydSample) * count);
+      memcpy (data->in + LYD_CHUNK + data->fill, in + done,
+              sizeof (LydSample) * count);
+      data->fill += count;
+      done += count;
+      if (data->fill == LYD_CHUNK)
         {
-          int tappos = data->pos + (max_length - length[j]) * vm->sample_rate;
-          while (tappos >= size)
-            tappos -= size;
-          result += data->old[tappos];
+          convolve_block (data, wave->spectra);
+          data->fill = 0;
         }
-      result /= (state->argc-1);
-
-      OUT = data->old[data->pos] = sample + result * 0.9;
-      data->pos ++;
-      while (data->pos >= size)
-        data->pos -= size;
     }
-  ALIGNED_ARGS_SILENCE;
 }
 
 /**********************************************************************/
@@ -629,18 +1348,13 @@ static inline void op_cycle (OP_ARGS)
     {
       pos = fmodf (freq * count * SAMPLE / vm->sample_rate, count);
 
-      switch (1 + (pos+count) % count)
-        {
-          case 1: OUT = ARG(1); break;
-          case 2: OUT = ARG(2); break;
-          case 3: OUT = ARG(3); break;
-          case 4: OUT = ARG(4); break;
-          case 5: OUT = ARG(5); break;
-          case 6: OUT = ARG(6); break;
-          case 7: OUT = ARG(7); break;
-        }
+      OUT = state->arg[1 + (pos + count) % count][i];
     }
   ALIGNED_ARGS_SILENCE;
 }
 
 /**********************************************************************/
+
+#include "bake.c"
+
+/**********************************************************************/
@@ -22,14 +22,14 @@
 #include <pthread.h>
 
 typedef struct _LydOp LydOp;
+typedef struct _LydNote LydNote;
+typedef struct _LydBake LydBake;
+typedef struct _LydCompiled LydCompiled;
 
 /* #define DEBUG_CLIPPING */
 
 /* LYD_MAX_ARGC                        8    is defined in lyd-extend.h */
 /* #define LYD_CHUNK                   128  defined in lyd-extend.h */
-#define LYD_MAX_ELEMENTS               128 /* largest compiled program */
-#define LYD_MAX_VARIABLES              16  /* maximum number of variables
-                                              per voice */
 #define LYD_MAX_CBS                    16  /* maximum number of registered
                                               callbacks */
 
@@ -43,6 +43,44 @@ typedef struct _LydOp LydOp;
                                               */
 
 #define LYD_ALIGN                      16    /* needed for tree-vectorize SIMD*/
+#define LYD_LIMITER_LOOKAHEAD          32    /* samples of master limiter
+                                                lookahead (added latency) */
+#define LYD_LIMITER_CEILING            0.98  /* peak output level */
+#define LYD_LIMITER_RELEASE            0.05  /* seconds for limiter to
+                                                recover most of its gain */
+#define LYD_SLAB_SIZE                  65536 /* bytes per chunk slab, must be
+                                                a power of two */
+#define LYD_ARENA_SIZE                 (2 * 1024 * 1024) /* bytes mapped at
+                                                a time for slabs, one huge page */
+#define LYD_MAX_CHANNELS               8     /* largest speaker layout the
+                                                spatializer handles */
+#define LYD_MAX_RECYCLED               32    /* freed voices kept per program
+                                                for reuse */
+#define LYD_MAX_BUSES                  32    /* effect buses, including the
+                                                unused slot 0 (master) */
+#define LYD_MAX_GLOBALS                32    /* engine-global modulators */
+#define LYD_NOTE_BUCKETS               256   /* hash buckets of the rendered
+                                                note cache, power of two */
+#define LYD_PROGRAM_BUCKETS            64    /* hash buckets of the compiled
+                                                program cache, power of two */
+#define LYD_PROGRAM_CACHE              64    /* compiled programs kept for
+                                                their source */
+#define LYD_MAX_BAKED                  8     /* periodic subexpressions
+                                                baked per program */
+#define LYD_BAKE_SIZE                  2048  /* samples in a baked cycle */
+#define LYD_BAKE_LEVELS                11    /* band limited copies, from
+                                                1023 harmonics down to 1 */
+#define LYD_BAKE_OVERSAMPLE            4     /* of the cycle sampled for
+                                                baking */
+#define LYD_MAX_UNISON                 16    /* voices of unison ops */
+#define LYD_WAVETABLE_FRAME            2048  /* samples per frame of wavetable() */
+#define LYD_MAX_GRAINS                 256   /* overlapping grains of grains() */
+#define LYD_MAX_PARTIALS               128   /* partials of additive(), a
+                                                multiple of ADDITIVE_LANES */
+#define LYD_CONVOLVE_PARTITIONS        256   /* blocks of LYD_CHUNK samples of
+                                                an impulse response used by
+                                                convolve(), bounds the ~1KB
+                                                per block each voice keeps */
 
 
 /* The following features can be disabled by commenting them out */
@@ -66,13 +104,22 @@ typedef enum
 
 LydSample *lyd_chunk_new  (Lyd *lyd);
 void       lyd_chunk_free (Lyd *lyd, LydSample *chunk);
+void       lyd_chunks_destroy (Lyd *lyd);
+
+/* accounted allocations, for delay lines and other larger op data,
+ * the memory is zeroed */
+void      *lyd_mem_alloc  (Lyd *lyd, size_t size);
+void       lyd_mem_free   (Lyd *lyd, void *mem);
+
+typedef struct _LydArena LydArena;
 
 
 struct _LydOp
 {
   LydOpCode op;                /* The operation to execute */
   int       argc;              /* argument count */
-  float     arg[LYD_MAX_ARGC]; /* arguments to operation */
+  float    *arg;               /* arguments to operation, as many as the op
+                                  reads or was passed, in the program args */
 };
 
 #ifdef LYD_EXTENDABLE
@@ -95,12 +142,6 @@ struct _LydOpInfo  /* structure describing an extension to lyd
 };
 #endif
 
-struct _LydProgram
-{
-  LydOp commands[LYD_MAX_ELEMENTS];
-};
-
-
 /* "hashing to floating point number
  * of the first few chars in a string
  */
@@ -127,7 +168,9 @@ static inline float str2float (const char *str)
 #define TRUE  1
 #define FALSE 0
 #define G_UNLIKELY(arg)     arg
+#define g_malloc(size)      malloc (size)
 #define g_malloc0(size)     calloc (1, size)
+#define g_realloc(buf,size) realloc (buf, size)
 #define g_new0(type, n)     calloc (n, sizeof(type))
 #define g_free(buf)         free (buf)
 #define g_strdup(a)         strdup(a)
@@ -197,6 +240,27 @@ static inline SList *slist_find (SList *list, void *data)
   return list;
 }
 
+struct _LydProgram
+{
+  int              ref_count;  /* the owner and every live vm hold one */
+  pthread_mutex_t  mutex;      /* protects the fields below */
+  LydVM           *prototype;  /* initialized vm new voices are copied from */
+  SList           *retired;    /* earlier prototypes, for another lyd or
+                                  sample rate, possibly still shared */
+  LydVM           *recycled;   /* freed vms of prototype kept for reuse */
+  int              n_recycled;
+  int              opcount;    /* states in a vm, including the terminator */
+  int              arg_slots;  /* arg and literal pointers of the states */
+  int              deterministic; /* 1 if voices only depend on variables
+                                     and duration, -1 if not, 0 unknown */
+  LydBake         *bake[LYD_MAX_BAKED]; /* periodic subexpressions the
+                                           compiler replaced with baked() */
+  int              n_bake;
+  LydOp           *commands;   /* terminated by a 0 op, and like args
+                                  allocated after the LydProgram */
+  float           *args;       /* storage for the arguments of commands */
+};
+
 #define LOCK()    pthread_mutex_lock(&lyd->mutex)
 #define UNLOCK()  pthread_mutex_unlock(&lyd->mutex)
 
@@ -207,8 +271,48 @@ typedef struct LydWave
   int    samples;
   int    sample_rate;
   float *data;
+  float *spectra;    /* partitioned transform used by convolve(), made when
+                        loading and shared by all voices */
+  int    partitions;
+  int    generation; /* compile_version when loaded, tells a reloaded wave
+                        apart from the one it replaced */
 } LydWave;
 
+/* fills in the spectra and partitions of a wave, at most
+ * LYD_CONVOLVE_PARTITIONS blocks of LYD_CHUNK samples */
+void lyd_wave_spectra (LydWave *wave);
+
+/* an effect bus, voices and other buses mix into it and its effect runs
+ * once per chunk for each channel, see lyd_set_bus */
+typedef struct LydBus
+{
+  char      *name;
+  int        output;                   /* bus fed, 0 for the master mix */
+  int        depth;                    /* buses between this and master */
+  LydFilter *filter[LYD_MAX_CHANNELS]; /* effect for each channel, or NULL */
+  LydSample *buf[LYD_MAX_THREADS];     /* planar input for each render
+                                          thread */
+  LydSample *pending;                  /* collapsed input of the period
+                                          awaiting the master stage when
+                                          pipelined */
+  int        buf_len;
+} LydBus;
+
+/* a modulator evaluated once per period and read by any number of
+ * voices, see lyd_set_global */
+typedef struct LydGlobal
+{
+  char      *name;
+  LydFilter *filter;  /* generating program, or NULL for silence */
+  LydSample *buf;     /* values for the current period */
+  int        buf_len;
+  int        samples; /* valid samples in buf */
+  LydSample *pending; /* values of the period awaiting the master stage
+                         when pipelined, swapped with buf */
+  int        pending_len;
+  int        pending_samples;
+} LydGlobal;
+
 typedef struct LydMic
 {
   char  *name;
@@ -223,8 +327,23 @@ typedef struct LydMic
 struct _Lyd
 {
   pthread_mutex_t mutex;
-  pthread_mutex_t mmutex;
-  SList          *chunk_pools;
+  pthread_mutex_t mmutex;      /* protects the chunk depot */
+  SList          *chunk_pools; /* slabs chunks are allocated from */
+  LydSample      *chunk_free;  /* depot of free chunks (see lyd-alloc.c) */
+  LydArena       *arenas;      /* mappings slabs are carved from */
+  int             hugepages;   /* whether to ask for huge page backing */
+  long            mem_used;    /* bytes in slabs and lyd_mem_alloc blocks */
+  long            mem_budget;  /* refuse new voices above this, 0 = no limit */
+  pthread_mutex_t pmutex;      /* protects programs */
+  SList          *programs;    /* programs with a prototype for this lyd */
+  pthread_mutex_t cmutex;      /* protects the compiled program cache */
+  LydCompiled    *program_bucket[LYD_PROGRAM_BUCKETS]; /* programs by source */
+  LydCompiled    *program_newest; /* most recently used end of the LRU list */
+  LydCompiled    *program_oldest;
+  int             programs_cached;
+  int             compile_version; /* bumped when ops or wave slots change,
+                                      or a wave is missing, the same source
+                                      may compile differently */
 
   int       sample_rate; /* sample rate */
   LydFormat format;      /* */
@@ -247,13 +366,32 @@ struct _Lyd
   void     *var_handler_destroy_data;
 
 
-  LydSample level;
+  LydSample  limiter_gain;   /* master gain reached by the limiter */
+  LydSample  limiter_end;    /* gain the current limiter block ramps to */
+  LydSample  limiter_peak;   /* of the block arriving into the delay ring */
+  int        limiter_pos;    /* position in the ring, blocks start at 0 */
+  LydSample  limiter_delay[LYD_MAX_CHANNELS][LYD_LIMITER_LOOKAHEAD];
   int       active;
   int       max_active;
 
+  int       channels;    /* number of planar channels in the mix buffers */
+
   LydFilter *global_filter[2];  /* a global filter applied to all generated sound,
                                    one instance for each channel
                                 */
+  LydBus    *bus[LYD_MAX_BUSES];       /* effect buses, indexed from 1 */
+  int        bus_order[LYD_MAX_BUSES]; /* buses deepest first */
+  int        bus_count;
+  LydGlobal *global[LYD_MAX_GLOBALS];
+  int        global_count;
+
+  LydNote   *note_bucket[LYD_NOTE_BUCKETS]; /* rendered note cache */
+  LydNote   *note_newest;     /* most recently used end of the LRU list */
+  LydNote   *note_oldest;
+  long       note_cache_max;  /* bytes of pcm kept, 0 disables the cache */
+  long       note_cache_size;
+  long       note_hits;
+  long       note_misses;
 
   int   voice_count;
   float i_voice_count; /* 1.0/voice_count */
@@ -273,6 +411,24 @@ struct _Lyd
   LydSample      *buf[1];
 #endif
   int             buf_len;
+  LydSample      *mix[LYD_MAX_CHANNELS]; /* planar master mix, either in
+                                            buf[0] or the caller's buffers */
+
+  int             pipelined;    /* run the master stage a period behind the
+                                   voices, see lyd_set_pipelined */
+  LydSample      *pipe_buf;     /* planar mix of the period awaiting the
+                                   master stage */
+  int             pipe_samples; /* length of that period, 0 for none */
+#ifdef LYD_THREADED
+  int             master_started;
+  pthread_t       master_tid;
+  pthread_mutex_t master_mutex;
+  pthread_cond_t  master_cond;
+  int             master_pending;
+  int             master_stop;  /* asks the master thread to exit */
+  int             master_samples;
+  void           *master_stream[2];
+#endif
 
 
   /* XXX: nees destroy_notifys */
@@ -300,6 +456,22 @@ struct _LydVM
 {
   Lyd      *lyd;      /* backpointer to the lyd instance */
   LydSample position; /* 0.0 center -1.0 left 1.0 right */
+  LydSample gain_position;          /* position gain[] was computed for */
+  LydSample gain[LYD_MAX_CHANNELS]; /* per channel gain reached at the end
+                                       of the previous chunk */
+  int       period_pos;  /* offset of the chunk being computed within the
+                            period, where global modulators are read */
+  int       pending_globals; /* read the globals held back with the mix,
+                                set for bus effects in the pipelined
+                                master stage */
+  int       bus;         /* bus the voice is mixed into, 0 for master */
+  int       send;        /* bus receiving an extra send, 0 for none */
+  LydSample send_amount; /* level of the send */
+  int       note_checked; /* looked up in the note cache when starting */
+  LydNote  *replay;  /* cached rendering played instead of computing */
+  LydNote  *record;  /* rendering being recorded for the note cache */
+  int       catch_up; /* 1 when the vm is to be brought to where replay
+                         got, 2 once it has been */
   LydSample duration; /* how long the sample should last */
   int       released; /* the number of samples we have been released, calling
                          voice_release increments this and starts the release
@@ -321,6 +493,10 @@ struct _LydVM
   int        input_buf_len;
 
   SList      *params;  /* list of key-lists variable interpolation params */
+  LydProgram *program;   /* program instantiated, referenced while alive */
+  LydVM      *prototype; /* vm owning the shared literals, NULL for a
+                            prototype itself */
+  LydVM      *next_free; /* link in the program's recycled list */
   LydOpState *state;   /* points to immediately after the allocation
                           of LydVM (padded for alignment). */
 };
@@ -342,7 +518,44 @@ lyd_vm_set_complete_cb (LydVM *vm,
   void *data);
 
 void lyd_vm_free (LydVM *vm);
+
+/* compute constant power panning gains for position -1.0..1.0 spread over
+ * channels speakers, unity gain on a speaker and 0.707 for both channels at
+ * stereo center */
+void lyd_pan_gains (LydSample position, int channels, LydSample *gains);
+void lyd_buses_free (Lyd *lyd);
+void lyd_globals_free (Lyd *lyd);
+
+void       lyd_notes_start      (Lyd *lyd, LydVM *voice);
+void       lyd_notes_record     (LydVM *voice, LydSample *result, int samples);
+LydSample *lyd_notes_replay     (LydVM *voice, int samples, LydSample *scratch);
+void       lyd_notes_store      (Lyd *lyd, LydVM *voice);
+void       lyd_notes_follow     (Lyd *lyd, LydVM *voice, int samples);
+void       lyd_notes_release    (Lyd *lyd, LydVM *voice);
+void       lyd_notes_detach     (LydVM *voice);
+void       lyd_notes_catch_up   (LydVM *voice);
+void       lyd_notes_voice_free (LydVM *voice);
+void       lyd_notes_flush      (Lyd *lyd);
+
+LydBake *lyd_bake_new (const float *cycle, float ratio);
+void lyd_bake_free (LydBake *bake);
+float lyd_bake_oscillator (LydOpCode op, float p);
+int  lyd_global_declare (Lyd *lyd, const char *name, LydProgram *program,
+                         int replace);
 LydVM * lyd_vm_create (Lyd *lyd, LydProgram *program);
+/* a voice with its parameters, position and bus set under the same lock
+ * that adds it, so a render thread never starts it half set up */
+LydVoice *lyd_voice_new_note (Lyd *lyd, LydProgram *program, float hz,
+                              float volume, float duration, float pan,
+                              int tag, const char *bus);
+int     lyd_op_argc   (Lyd *lyd, int op);
+
+void lyd_program_unref   (LydProgram *program);
+/* drop the programs kept by lyd_compile for reuse */
+void lyd_program_cache_flush (Lyd *lyd);
+/* free the recycled voices programs keep for lyd, and with forget also the
+ * prototypes, done before lyd goes away */
+void lyd_programs_flush  (Lyd *lyd, int forget);
 
 
 #endif
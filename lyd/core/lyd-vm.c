@@ -29,6 +29,9 @@
 
 static LydSample *lyd_vm_chunk_new (LydVM *vm);
 static void       lyd_vm_chunk_free (LydVM *vm, LydSample *chunk);
+static void       lyd_filter_process_at (LydFilter *filter, LydSample **inputs,
+                                         int n_inputs, LydSample *output,
+                                         int samples, int period_pos);
 
 static int lyd_op_argca[]=
 {
@@ -53,7 +56,7 @@ static LydOpInfo *lyd_op_info (Lyd *lyd, LydOpCode op)
 }
 #endif
 
-static int
+int
 lyd_op_argc (Lyd *lyd, int op)
 {
   if (op < LydLastOp)
@@ -68,28 +71,55 @@ lyd_op_argc (Lyd *lyd, int op)
   return 0;
 }
 
-/* create a new vm from a program */
-LydVM * lyd_vm_create (Lyd *lyd, LydProgram *program)
+/* the argument slots of a command, ops taking any number of arguments
+ * get as many as they were passed */
+static inline int lyd_op_slots (Lyd *lyd, LydOp *command)
+{
+  int argc = lyd_op_argc (lyd, command->op);
+  if (argc < command->argc)
+    argc = command->argc;
+  return argc < LYD_MAX_ARGC ? LYD_MAX_ARGC : argc;
+}
+
+/* bytes of a vm for program, the LydVM is followed by the states and the
+ * arg and literal arrays of the states */
+static inline size_t lyd_vm_size (LydProgram *program)
+{
+  return sizeof (LydVM) + sizeof (LydOpState) * program->opcount +
+         sizeof (LydSample *) * 2 * program->arg_slots;
+}
+
+/* Voices are not built from the program directly, each program keeps an
+ * initialized prototype vm - with literals filled in and envelope times
+ * premultiplied - that new voices are copied from. The clones share the
+ * read only literal chunks of the prototype, only the variable values
+ * (literal 0 of the nops) and the output chunks are per voice.
+ */
+static LydVM *lyd_vm_prototype_new (Lyd *lyd, LydProgram *program)
 {
   LydVM *vm;
   int i, j;
   LydOpState *state;
-  LydOpState *states[LYD_MAX_ELEMENTS];
+  LydSample **slot;
 
   /* compute size of allocation */
   int opcount;
-  int arg_count = 0;
-  int codesize;
+  int arg_slots = 0;
   for (opcount = 0; program->commands[opcount].op; opcount++)
-    arg_count += lyd_op_argc (lyd, program->commands[opcount].op);
+    arg_slots += lyd_op_slots (lyd, &program->commands[opcount]);
   opcount++;
-  codesize = sizeof (LydOpState) * opcount;
+  program->opcount = opcount;
+  program->arg_slots = arg_slots;
 
   /* allocate memory */
-  vm = g_malloc0 (sizeof (LydVM) + codesize);
+  vm = g_malloc0 (lyd_vm_size (program));
   vm->lyd = lyd;
+  vm->program = program;
+  vm->sample_rate = lyd->sample_rate;
+  vm->i_sample_rate = 1.0/lyd->sample_rate;
   vm->state = (LydOpState*)(((char *)vm) + sizeof (LydVM));
   state = vm->state;
+  slot = (LydSample **)(vm->state + opcount);
 
   /* fill in opstate from program, initializing
    * everything needed to start running the vm */
@@ -101,14 +131,19 @@ LydVM * lyd_vm_create (Lyd *lyd, LydProgram *program)
                             by the lyd allocator, making the aliasing not
                             be a problem as long as the related chunks are
                             freed in one go */
-      states[i] = state;
       state->op = program->commands[i].op;
       state->argc = program->commands[i].argc;
       state->info = lyd_op_info (lyd, state->op);
+      state->slots = lyd_op_slots (lyd, &program->commands[i]);
+      state->arg = slot;
+      state->literal = slot + state->slots;
+      slot += 2 * state->slots;
       /* these argc's might differ, if we want stricter checking it
        * should happen foremost in the compiler
        */
       argc = lyd_op_argc (lyd, state->op);
+      if (argc < state->argc)
+        argc = state->argc;
 
       state->next = (LydOpState*)(((char *)state) + sizeof (LydOpState));
 
@@ -131,9 +166,9 @@ LydVM * lyd_vm_create (Lyd *lyd, LydProgram *program)
                * by multiple ops, and thus should not be
                * overwritten
                */
-              if (outarg<0 && states[i + offset]->op != LYD_NOP)
+              if (outarg<0 && vm->state[i + offset].op != LYD_NOP)
                 outarg = j;
-              state->arg[j] = &states[i + offset]->out[0];
+              state->arg[j] = &vm->state[i + offset].out[0];
             }
           else
             {
@@ -179,20 +214,170 @@ LydVM * lyd_vm_create (Lyd *lyd, LydProgram *program)
             break;
         }
 
-      if (state->info)
+      state = state->next;
+    }
+  vm->position = 0.0;
+
+  return vm;
+}
+
+/* index of the literal chunk a clone cannot share with its prototype, the
+ * value of a variable or the input buffer reused as output, -1 if none */
+static inline int lyd_state_private_literal (LydOpState *state)
+{
+  int j;
+  if (state->op == LYD_NOP)
+    return 0;
+  if (state->out_is_clone)
+    for (j = 0; j < state->slots; j++)
+      if (state->literal[j] == state->out)
+        return j;
+  return -1;
+}
+
+/* free the chunks a vm owns and the vm itself, op data should already
+ * be freed */
+static void lyd_vm_destroy (LydVM *vm)
+{
+  LydOpState *state;
+
+  for (state = vm->state; state->op; state++)
+    {
+      int j;
+      if (!state->out_is_clone)
+        lyd_vm_chunk_free (vm, state->out);
+      if (!vm->prototype)
         {
-          if (state->info->program)
-            {
-              state->data = lyd_filter_new (vm->lyd, state->info->program);
-            }
-          else if (state->info->init)
-            state->info->init (vm, state);
+          for (j = 0; j < state->slots; j++)
+            if (state->literal[j])
+              lyd_vm_chunk_free (vm, state->literal[j]);
         }
+      else if ((j = lyd_state_private_literal (state)) >= 0)
+        lyd_vm_chunk_free (vm, state->literal[j]);
+    }
+  g_free (vm);
+}
 
-      state = state->next;
+static void lyd_program_flush_recycled (LydProgram *program)
+{
+  while (program->recycled)
+    {
+      LydVM *vm = program->recycled;
+      program->recycled = vm->next_free;
+      lyd_vm_destroy (vm);
     }
-  vm->position = 0.0;
+  program->n_recycled = 0;
+}
+
+/* create a new vm from a program */
+LydVM * lyd_vm_create (Lyd *lyd, LydProgram *program)
+{
+  LydVM      *proto;
+  LydVM      *vm;
+  LydOpState *src, *dst;
+  int         recycled;
+  int         registered = 1;
+  int         i;
+
+  pthread_mutex_lock (&program->mutex);
+  proto = program->prototype;
+  if (!proto || proto->lyd != lyd || proto->sample_rate != lyd->sample_rate)
+    {
+      lyd_program_flush_recycled (program);
+      if (proto)
+        program->retired = slist_prepend (program->retired, proto);
+      proto = program->prototype = lyd_vm_prototype_new (lyd, program);
+      registered = 0;
+    }
+  vm = program->recycled;
+  if (vm)
+    {
+      program->recycled = vm->next_free;
+      program->n_recycled--;
+    }
+  program->ref_count++;
+  pthread_mutex_unlock (&program->mutex);
+
+  if (!registered)
+    {
+      pthread_mutex_lock (&lyd->pmutex);
+      if (!slist_find (lyd->programs, program))
+        lyd->programs = slist_prepend (lyd->programs, program);
+      pthread_mutex_unlock (&lyd->pmutex);
+    }
+
+  recycled = vm != NULL;
+  if (recycled) /* keeps its chunks, only the header is reset here */
+    memcpy (vm, proto, sizeof (LydVM));
+  else
+    {
+      int size = lyd_vm_size (program);
+      vm = g_malloc (size);
+      memcpy (vm, proto, size);
+    }
+  vm->state = (LydOpState*)(((char *)vm) + sizeof (LydVM));
+  vm->prototype = proto;
+  vm->next_free = NULL;
+
+  /* fix up the pointers of the copied states */
+  for (i = 0, src = proto->state, dst = vm->state; src->op; i++, src++, dst++)
+    {
+      int        priv = lyd_state_private_literal (src);
+      LydSample *out = NULL;
+      LydSample *literal = NULL;
+      int        j;
+
+      if (recycled)
+        {
+          out = dst->out;
+          if (priv >= 0)
+            literal = dst->literal[priv];
+          *dst = *src;
+        }
+      dst->next = dst + 1;
+      /* the arrays are at the same place in the copy */
+      dst->arg = (void*)((char*)vm + ((char*)src->arg - (char*)proto));
+      dst->literal = (void*)((char*)vm + ((char*)src->literal - (char*)proto));
+
+      /* chunks kept from the recycled voice still hold its last output,
+       * cleared like fresh ones since ops may read their output before
+       * writing it */
+      if (priv >= 0)
+        {
+          dst->literal[priv] = literal ? literal : lyd_vm_chunk_new (vm);
+          if (src->op == LYD_NOP)
+            memcpy (dst->literal[priv], src->literal[priv],
+                    sizeof (LydSample) * LYD_CHUNK);
+          else if (literal)
+            memset (literal, 0, sizeof (LydSample) * LYD_CHUNK);
+        }
+      if (src->out_is_clone)
+        dst->out = dst->literal[priv];
+      else if (out)
+        {
+          memset (out, 0, sizeof (LydSample) * LYD_CHUNK);
+          dst->out = out;
+        }
+      else
+        dst->out = lyd_vm_chunk_new (vm);
+
+      for (j = 0; j < src->slots; j++)
+        if (src->arg[j])
+          {
+            if (src->arg[j] == src->literal[j])
+              dst->arg[j] = dst->literal[j];
+            else
+              dst->arg[j] = vm->state[i + (int)program->commands[i].arg[j]].out;
+          }
 
+      if (dst->info)
+        {
+          if (dst->info->program)
+            dst->data = lyd_filter_new (lyd, dst->info->program);
+          else if (dst->info->init)
+            dst->info->init (vm, dst);
+        }
+    }
   return vm;
 }
 
@@ -203,23 +388,11 @@ LydVM * lyd_vm_create (Lyd *lyd, LydProgram *program)
 void
 lyd_vm_free (LydVM *vm)
 {
+  LydProgram *program = vm->program;
   LydOpState *state;
 
   for (state = vm->state; state->op; state=state->next)
     {
-      int i;
-      int argc = lyd_op_argc (vm->lyd, state->op);
-
-      if (!state->out_is_clone)
-        lyd_vm_chunk_free (vm, state->out);
-      state->out = NULL;
-
-      for (i = 0; i< argc; i++)
-        {
-          if (state->literal[i] && 0)
-            lyd_vm_chunk_free (vm, state->literal[i]);
-        }
-
       if (state->data)
         {
           switch (state->op)
@@ -236,9 +409,12 @@ lyd_vm_free (LydVM *vm)
                 lyd_filter_free (state->data);
               break;
             }
+          state->data = NULL;
         }
     }
 
+  lyd_notes_voice_free (vm);
+
   /* free unused parameter keys */
   if (vm->params)
   {
@@ -250,8 +426,108 @@ lyd_vm_free (LydVM *vm)
         slist_free (l1->data);
       }
     slist_free (vm->params);
+    vm->params = NULL;
   }
-  g_free (vm);
+
+  /* keep the vm with its chunks for the next voice of the program */
+  pthread_mutex_lock (&program->mutex);
+  if (vm->prototype == program->prototype &&
+      program->n_recycled < LYD_MAX_RECYCLED)
+    {
+      vm->next_free = program->recycled;
+      program->recycled = vm;
+      program->n_recycled++;
+      vm = NULL;
+    }
+  pthread_mutex_unlock (&program->mutex);
+
+  if (vm)
+    lyd_vm_destroy (vm);
+  lyd_program_unref (program);
+}
+
+void
+lyd_program_free (LydProgram *program)
+{
+  lyd_program_unref (program);
+}
+
+/* drop the prototypes made for lyd, or all of them if lyd is NULL */
+static void lyd_program_release (LydProgram *program, Lyd *lyd)
+{
+  SList *iter, *next;
+
+  if (program->prototype && (!lyd || program->prototype->lyd == lyd))
+    {
+      lyd_program_flush_recycled (program);
+      lyd_vm_destroy (program->prototype);
+      program->prototype = NULL;
+    }
+  for (iter = program->retired; iter; iter = next)
+    {
+      LydVM *proto = iter->data;
+      next = iter->next;
+      if (!lyd || proto->lyd == lyd)
+        {
+          program->retired = slist_remove (program->retired, proto);
+          lyd_vm_destroy (proto);
+        }
+    }
+}
+
+void lyd_program_unref (LydProgram *program)
+{
+  SList *iter;
+  int    dead;
+  int    i;
+
+  pthread_mutex_lock (&program->mutex);
+  dead = --program->ref_count == 0;
+  pthread_mutex_unlock (&program->mutex);
+  if (!dead)
+    return;
+
+  if (program->prototype)
+    program->retired = slist_prepend (program->retired, program->prototype);
+  for (iter = program->retired; iter; iter = iter->next)
+    {
+      Lyd *lyd = ((LydVM*)iter->data)->lyd;
+      pthread_mutex_lock (&lyd->pmutex);
+      if (slist_find (lyd->programs, program))
+        lyd->programs = slist_remove (lyd->programs, program);
+      pthread_mutex_unlock (&lyd->pmutex);
+    }
+  if (program->prototype)
+    program->retired = slist_remove (program->retired, program->prototype);
+
+  lyd_program_release (program, NULL);
+  for (i = 0; i < program->n_bake; i++)
+    lyd_bake_free (program->bake[i]);
+  pthread_mutex_destroy (&program->mutex);
+  g_free (program);
+}
+
+void lyd_programs_flush (Lyd *lyd, int forget)
+{
+  SList *iter;
+
+  pthread_mutex_lock (&lyd->pmutex);
+  for (iter = lyd->programs; iter; iter = iter->next)
+    {
+      LydProgram *program = iter->data;
+      pthread_mutex_lock (&program->mutex);
+      if (forget)
+        lyd_program_release (program, lyd);
+      else if (program->prototype && program->prototype->lyd == lyd)
+        lyd_program_flush_recycled (program);
+      pthread_mutex_unlock (&program->mutex);
+    }
+  if (forget)
+    {
+      slist_free (lyd->programs);
+      lyd->programs = NULL;
+    }
+  pthread_mutex_unlock (&lyd->pmutex);
 }
 
 /* sine function lookup function, not very precise at the moment */
@@ -276,6 +552,7 @@ void lyd_init_lookup_tables (void)
   if (done)
     return;
   done = 1;
+  fft_init ();
   {
     unsigned int i;
     float step;
@@ -350,8 +627,9 @@ lyd_vm_compute (LydVM  *vm,
             if (state->info->process)
               state->info->process (vm, state, samples);
             else if (state->info->program)
-              lyd_filter_process (state->data, state->arg,
-                                  state->info->argc, state->out, samples);
+              lyd_filter_process_at (state->data, state->arg,
+                                     state->info->argc, state->out, samples,
+                                     vm->period_pos);
           }
 #endif
           break;
@@ -560,12 +838,14 @@ LydFilter  *lyd_filter_new (Lyd *lyd, LydProgram *program)
   return filter;
 }
 
-void
-lyd_filter_process (LydFilter  *filter,
-                    LydSample **inputs,
-                    int         n_inputs,
-                    LydSample  *output,
-                    int         samples)
+/* process samples, the first being at period_pos of the current period */
+static void
+lyd_filter_process_at (LydFilter  *filter,
+                       LydSample **inputs,
+                       int         n_inputs,
+                       LydSample  *output,
+                       int         samples,
+                       int         period_pos)
 {
   int left = samples;
   int pos = 0;
@@ -594,6 +874,7 @@ lyd_filter_process (LydFilter  *filter,
         chunk = left;
       left -= chunk;
 
+      filter->period_pos = period_pos + pos;
       lyd_vm_update_params (filter, chunk);
       result = lyd_vm_compute (filter, chunk);
       for (i = 0; i< chunk; i++)
@@ -602,6 +883,16 @@ lyd_filter_process (LydFilter  *filter,
     }
 }
 
+void
+lyd_filter_process (LydFilter  *filter,
+                    LydSample **inputs,
+                    int         n_inputs,
+                    LydSample  *output,
+                    int         samples)
+{
+  lyd_filter_process_at (filter, inputs, n_inputs, output, samples, 0);
+}
+
 void lyd_filter_free (LydFilter *filter)
 {
   lyd_vm_free (filter);
@@ -622,6 +913,8 @@ lyd_vm_set_complete_cb (LydVM *vm,
                         void  (*complete_cb)(void *data),
                         void *data)
 {
+  if (!vm)
+    return;
   vm->complete_cb = complete_cb;
   vm->complete_data = data;
 }
@@ -45,7 +45,10 @@ again:
 
 void lyd_voice_kill (LydVM *voice)
 {
-  Lyd *lyd = voice->lyd;
+  Lyd *lyd;
+  if (!voice)
+    return;
+  lyd = voice->lyd;
   LOCK ();
   if (slist_find (lyd->voices, voice))
     {
@@ -58,10 +61,14 @@ void lyd_voice_kill (LydVM *voice)
 LydVoice *
 lyd_voice_release (LydVM *voice)
 {
-  Lyd *lyd = voice->lyd;
+  Lyd *lyd;
+  if (!voice)
+    return NULL;
+  lyd = voice->lyd;
   LOCK ();
   if (slist_find (lyd->voices, voice))
     {
+      lyd_notes_release (lyd, voice);
       voice->released++;
       voice->silence_min = -100;
       voice->silence_max = 100;
@@ -107,6 +114,183 @@ void lyd_set_global_filter (Lyd *lyd, LydProgram *program)
     }
 }
 
+static int lyd_bus_find (Lyd *lyd, const char *name)
+{
+  int i;
+  if (!name)
+    return 0;
+  for (i = 1; i < LYD_MAX_BUSES; i++)
+    if (lyd->bus[i] && !strcmp (lyd->bus[i]->name, name))
+      return i;
+  return 0;
+}
+
+/* order buses by distance from the master mix, deepest first */
+static void lyd_bus_sort (Lyd *lyd)
+{
+  int i, j;
+  lyd->bus_count = 0;
+  for (i = 1; i < LYD_MAX_BUSES; i++)
+    if (lyd->bus[i])
+      {
+        LydBus *bus = lyd->bus[i];
+        bus->depth = 0;
+        for (j = i; j; j = lyd->bus[j]->output)
+          bus->depth++;
+        for (j = lyd->bus_count; j > 0 &&
+             lyd->bus[lyd->bus_order[j-1]]->depth < bus->depth; j--)
+          lyd->bus_order[j] = lyd->bus_order[j-1];
+        lyd->bus_order[j] = i;
+        lyd->bus_count++;
+      }
+}
+
+int lyd_set_bus (Lyd        *lyd,
+                 const char *name,
+                 LydProgram *effect,
+                 const char *output)
+{
+  LydBus *bus;
+  int     no, out, i;
+
+  if (!name)
+    return -1;
+  LOCK ();
+  out = lyd_bus_find (lyd, output);
+  no = lyd_bus_find (lyd, name);
+  if (output && !out)
+    {
+      UNLOCK ();
+      return -1;
+    }
+  if (!no)
+    {
+      for (no = 1; no < LYD_MAX_BUSES && lyd->bus[no]; no++);
+      if (no >= LYD_MAX_BUSES)
+        {
+          UNLOCK ();
+          return -1;
+        }
+      lyd->bus[no] = g_new0 (LydBus, 1);
+      lyd->bus[no]->name = g_strdup (name);
+    }
+  for (i = out; i; i = lyd->bus[i]->output) /* refuse loops */
+    if (i == no)
+      {
+        UNLOCK ();
+        return -1;
+      }
+
+  bus = lyd->bus[no];
+  bus->output = out;
+  for (i = 0; i < lyd->channels; i++)
+    {
+      if (bus->filter[i])
+        lyd_filter_free (bus->filter[i]);
+      bus->filter[i] = effect ? lyd_filter_new (lyd, effect) : NULL;
+    }
+  lyd_bus_sort (lyd);
+  UNLOCK ();
+  return 0;
+}
+
+void lyd_set_pipelined (Lyd *lyd, int pipelined)
+{
+  LOCK ();
+  lyd->pipelined = pipelined;
+  lyd->pipe_samples = 0;
+  UNLOCK ();
+}
+
+static int lyd_global_find (Lyd *lyd, const char *name)
+{
+  int i;
+  for (i = 0; i < lyd->global_count; i++)
+    if (!strcmp (lyd->global[i]->name, name))
+      return i;
+  return -1;
+}
+
+/* the slot of the named global modulator, created if needed, the program is
+ * only used for a new modulator or when replace is set */
+int lyd_global_declare (Lyd        *lyd,
+                        const char *name,
+                        LydProgram *program,
+                        int         replace)
+{
+  LydGlobal *global;
+  int        no;
+
+  LOCK ();
+  no = lyd_global_find (lyd, name);
+  if (no < 0)
+    {
+      if (lyd->global_count >= LYD_MAX_GLOBALS)
+        {
+          UNLOCK ();
+          return -1;
+        }
+      no = lyd->global_count;
+      lyd->global[no] = g_new0 (LydGlobal, 1);
+      lyd->global[no]->name = g_strdup (name);
+      lyd->global_count++;
+      replace = 1;
+    }
+  global = lyd->global[no];
+  if (replace && (program || global->filter))
+    {
+      if (global->filter)
+        lyd_filter_free (global->filter);
+      global->filter = program ? lyd_filter_new (lyd, program) : NULL;
+    }
+  UNLOCK ();
+  return no;
+}
+
+int lyd_set_global (Lyd        *lyd,
+                    const char *name,
+                    LydProgram *program)
+{
+  return lyd_global_declare (lyd, name, program, 1) < 0 ? -1 : 0;
+}
+
+void lyd_globals_free (Lyd *lyd)
+{
+  int i;
+  for (i = 0; i < lyd->global_count; i++)
+    {
+      LydGlobal *global = lyd->global[i];
+      if (global->filter)
+        lyd_filter_free (global->filter);
+      g_free (global->buf);
+      g_free (global->pending);
+      g_free (global->name);
+      g_free (global);
+      lyd->global[i] = NULL;
+    }
+  lyd->global_count = 0;
+}
+
+void lyd_buses_free (Lyd *lyd)
+{
+  int i, j;
+  for (i = 1; i < LYD_MAX_BUSES; i++)
+    if (lyd->bus[i])
+      {
+        LydBus *bus = lyd->bus[i];
+        for (j = 0; j < LYD_MAX_CHANNELS; j++)
+          if (bus->filter[j])
+            lyd_filter_free (bus->filter[j]);
+        for (j = 0; j < LYD_MAX_THREADS; j++)
+          g_free (bus->buf[j]);
+        g_free (bus->pending);
+        g_free (bus->name);
+        g_free (bus);
+        lyd->bus[i] = NULL;
+      }
+  lyd->bus_count = 0;
+}
+
 static LydVoice *lyd_voice_new_unlocked (Lyd       *lyd,
                                          LydProgram *program,
                                          int        tag)
@@ -117,10 +301,18 @@ static LydVoice *lyd_voice_new_unlocked (Lyd       *lyd,
   voice->i_sample_rate = 1.0/lyd->sample_rate;
   voice->tag = tag;
   voice->lyd = lyd;
+  lyd_pan_gains (voice->position, lyd->channels, voice->gain);
+  voice->gain_position = voice->position;
   lyd->voices = slist_prepend (lyd->voices, voice);
   return voice;
 }
 
+static int lyd_over_budget (Lyd *lyd)
+{
+  return lyd->mem_budget && lyd_get_memory_used (lyd) > lyd->mem_budget &&
+         (lyd_trim (lyd), lyd_get_memory_used (lyd) > lyd->mem_budget);
+}
+
 LydVoice *lyd_voice_new (Lyd        *lyd,
                          LydProgram *program,
                          double      delay,
@@ -128,25 +320,68 @@ LydVoice *lyd_voice_new (Lyd        *lyd,
 {
   LydVoice *voice;
   LOCK ();
+  if (lyd_over_budget (lyd))
+    {
+      UNLOCK ();
+      return NULL;
+    }
   voice = lyd_voice_new_unlocked (lyd, program, tag);
   voice->sample = - (delay * lyd->sample_rate);
   UNLOCK ();
   return voice;
 }
 
+LydVoice *lyd_voice_new_note (Lyd        *lyd,
+                              LydProgram *program,
+                              float       hz,
+                              float       volume,
+                              float       duration,
+                              float       pan,
+                              int         tag,
+                              const char *bus)
+{
+  LydVoice *voice;
+  LOCK ();
+  if (lyd_over_budget (lyd))
+    {
+      UNLOCK ();
+      return NULL;
+    }
+  voice = lyd_voice_new_unlocked (lyd, program, tag);
+  lyd_vm_set_param (voice, "volume", volume);
+  lyd_vm_set_param (voice, "hz", hz);
+  voice->duration = duration * lyd->sample_rate;
+  voice->position = pan;
+  lyd_pan_gains (voice->position, lyd->channels, voice->gain);
+  voice->gain_position = voice->position;
+  if (bus)
+    voice->bus = lyd_bus_find (lyd, bus);
+  UNLOCK ();
+  return voice;
+}
+
 LydVoice *lyd_voice_set_duration (LydVoice *voice, double seconds)
 {
-  Lyd *lyd = voice->lyd;
+  Lyd *lyd;
+  if (!voice)
+    return NULL;
+  lyd = voice->lyd;
   LOCK ();
   if (slist_find (lyd->voices, voice))
-    voice->duration = seconds * lyd->sample_rate;
+    {
+      lyd_notes_detach (voice);
+      voice->duration = seconds * lyd->sample_rate;
+    }
   UNLOCK ();
   return voice;
 }
 
 LydVoice *lyd_voice_set_delay (LydVoice *voice, double seconds)
 {
-  Lyd *lyd = voice->lyd;
+  Lyd *lyd;
+  if (!voice)
+    return NULL;
+  lyd = voice->lyd;
   LOCK ();
   if (slist_find (lyd->voices, voice))
     voice->sample = - (seconds * lyd->sample_rate);
@@ -160,6 +395,7 @@ void lyd_midi_iterate (Lyd *lyd, float elapsed);
 
 #ifdef LYD_THREADED
 void lyd_worker_threads_init (Lyd *lyd);
+void lyd_master_stop (Lyd *lyd);
 #endif
 
 Lyd * lyd_new (void)
@@ -167,7 +403,11 @@ Lyd * lyd_new (void)
   Lyd *lyd = g_new0 (Lyd, 1);
   pthread_mutex_init(&lyd->mutex, NULL);
   pthread_mutex_init(&lyd->mmutex, NULL);
+  pthread_mutex_init(&lyd->pmutex, NULL);
+  pthread_mutex_init(&lyd->cmutex, NULL);
   lyd->max_active = 4000;
+  lyd->channels = 2;
+  lyd->limiter_gain = 1.0;
 #ifdef LYD_EXTENDABLE
   lyd->last_op = LydLastOp;
 #endif
@@ -221,6 +461,49 @@ void lyd_set_format (Lyd *lyd, LydFormat format)
   lyd->format = format;
 }
 
+int lyd_set_channels (Lyd *lyd, int channels)
+{
+  SList *iter;
+  int    no, c;
+
+  if (channels < 1 || channels > LYD_MAX_CHANNELS)
+    return -1;
+  LOCK ();
+  /* buses have an instance of their effect for each channel */
+  for (no = 1; no < LYD_MAX_BUSES; no++)
+    {
+      LydBus *bus = lyd->bus[no];
+      if (!bus)
+        continue;
+      for (c = channels; c < lyd->channels; c++)
+        if (bus->filter[c])
+          {
+            lyd_filter_free (bus->filter[c]);
+            bus->filter[c] = NULL;
+          }
+      for (c = lyd->channels; c < channels; c++)
+        if (bus->filter[0])
+          bus->filter[c] = lyd_filter_new (lyd, bus->filter[0]->program);
+      bus->buf_len = 0; /* reallocated for the new count */
+    }
+  for (iter = lyd->voices; iter; iter = iter->next)
+    {
+      LydVM *voice = iter->data;
+      lyd_pan_gains (voice->position, channels, voice->gain);
+      voice->gain_position = voice->position;
+    }
+  memset (lyd->limiter_delay, 0, sizeof (lyd->limiter_delay));
+  lyd->channels = channels;
+  lyd->buf_len = 0; /* the mix buffers as well */
+  UNLOCK ();
+  return 0;
+}
+
+int lyd_get_channels (Lyd *lyd)
+{
+  return lyd->channels;
+}
+
 int lyd_dead;
 
 static void
@@ -228,6 +511,7 @@ lyd_wave_free (LydWave *wave)
 {
   g_free (wave->name);
   g_free (wave->data);
+  g_free (wave->spectra);
   g_free (wave);
 }
 
@@ -235,6 +519,9 @@ void lyd_free (Lyd *lyd)
 {
   int i;
   lyd_dead = 1;
+#ifdef LYD_THREADED
+  lyd_master_stop (lyd); /* it renders from and waits inside lyd */
+#endif
   for (i = 0; i < LYD_MAX_WAVE; i++)
     if (lyd->wave[i])
       lyd_wave_free (lyd->wave[i]);
@@ -242,31 +529,81 @@ void lyd_free (Lyd *lyd)
   /* XXX: shutdown properly */
   /* XXX: free per thread render bufs */
   /* XXX: free still active voices */
-  /* XXX: free chunk pools */
+  lyd_buses_free (lyd);
+  lyd_globals_free (lyd);
+  lyd_program_cache_flush (lyd);
+  lyd_notes_flush (lyd);
+  lyd_programs_flush (lyd, 1);
+  lyd_chunks_destroy (lyd);
   g_free (lyd);
 }
 
 LydVoice *lyd_voice_set_position (LydVoice *voice,
                                   double    position)
 {
-  Lyd *lyd = voice->lyd;
+  Lyd *lyd;
+  if (!voice)
+    return NULL;
+  lyd = voice->lyd;
   LOCK ();
   if (slist_find (lyd->voices, voice))
-    voice->position = position;
+    {
+      voice->position = position;
+      if (voice->sample <= 0) /* not started yet, no need to ramp */
+        {
+          lyd_pan_gains (voice->position, lyd->channels, voice->gain);
+          voice->gain_position = voice->position;
+        }
+    }
   UNLOCK ();
   return voice;
 }
 
+LydVoice *lyd_voice_set_bus (LydVoice   *voice,
+                             const char *bus)
+{
+  Lyd *lyd;
+  if (!voice)
+    return NULL;
+  lyd = voice->lyd;
+  LOCK ();
+  if (slist_find (lyd->voices, voice))
+    voice->bus = lyd_bus_find (lyd, bus);
+  UNLOCK ();
+  return voice;
+}
+
+LydVoice *lyd_voice_set_send (LydVoice   *voice,
+                              const char *bus,
+                              double      amount)
+{
+  Lyd *lyd;
+  if (!voice)
+    return NULL;
+  lyd = voice->lyd;
+  LOCK ();
+  if (slist_find (lyd->voices, voice))
+    {
+      voice->send = lyd_bus_find (lyd, bus);
+      voice->send_amount = amount;
+    }
+  UNLOCK ();
+  return voice;
+}
 
 LydVoice *
 lyd_voice_set_param (LydVoice   *voice,
                      const char *param,
                      double      value)
 {
-  Lyd *lyd = voice->lyd;
+  Lyd *lyd;
+  if (!voice)
+    return NULL;
+  lyd = voice->lyd;
   LOCK ();
   if (slist_find (lyd->voices, voice))
     {
+      lyd_notes_detach (voice);
       lyd_vm_set_param (voice, param, value);
     }
   UNLOCK ();
@@ -279,10 +616,14 @@ lyd_voice_set_param_delayed (LydVoice    *voice,
                              LydInterpolation interpolation,
                              double      value)
 {
-  Lyd *lyd = voice->lyd;
+  Lyd *lyd;
+  if (!voice)
+    return NULL;
+  lyd = voice->lyd;
   LOCK ();
   if (slist_find (lyd->voices, voice))
     {
+      lyd_notes_detach (voice);
       lyd_vm_set_param_delayed (voice, param_name, time, interpolation, value);
     }
   UNLOCK ();
@@ -352,10 +693,21 @@ void
 lyd_load_wave (Lyd *lyd, const char *name,
               int  samples, int sample_rate, float *data)
 {
-  LydWave *wave;
+  LydWave *wave = NULL;
   int i;
+
+  if (data && samples)
+    { /* the transform for convolve() is made here, not while rendering */
+      wave = g_new0 (LydWave, 1);
+      wave->name = g_strdup (name);
+      wave->data = g_malloc0 (sizeof (float) * samples);
+      wave->samples = samples;
+      wave->sample_rate = sample_rate;
+      memcpy (wave->data, data, sizeof (float) * samples);
+      lyd_wave_spectra (wave);
+    }
+
   LOCK ();
-  wave = g_new0 (LydWave, 1);
   for (i = 0; i < LYD_MAX_WAVE; i++)
     {
       LydWave *p = lyd->wave[i];
@@ -363,21 +715,20 @@ lyd_load_wave (Lyd *lyd, const char *name,
         {
           lyd_wave_free (p);
           lyd->wave[i] = NULL;
+          /* programs refer to waves by slot, a new wave in an empty slot
+           * changes none of them */
+          lyd->compile_version++;
           break;
         }
     }
 
-  if (data == NULL || samples == 0)
+  if (!wave)
     {
       UNLOCK ();
       return;
     }
 
-  wave->name = g_strdup (name);
-  wave->data = g_malloc0 (sizeof (float) * samples);
-  wave->samples = samples;
-  wave->sample_rate = sample_rate;
-  memcpy (wave->data, data, sizeof (float) * samples);
+  wave->generation = lyd->compile_version;
   for (i = 0; i < LYD_MAX_WAVE; i++)
     if (!lyd->wave[i])
       {
@@ -388,6 +739,44 @@ lyd_load_wave (Lyd *lyd, const char *name,
   UNLOCK ();
 }
 
+int
+lyd_load_wave_expression (Lyd        *lyd,
+                          const char *name,
+                          int         samples,
+                          const char *code)
+{
+  LydProgram *program;
+  LydFilter  *filter;
+  float      *data;
+  int         frame, frames, i;
+
+  if (samples < 1 || !(program = lyd_compile (lyd, code)))
+    return -1;
+  filter = lyd_filter_new (lyd, program);
+  lyd_program_free (program);
+
+  /* frames as wavetable() reads them */
+  frame = samples < LYD_WAVETABLE_FRAME ? samples : LYD_WAVETABLE_FRAME;
+  frames = samples / frame;
+
+  /* a sample at a time, with x and position set for each */
+  data = g_malloc (sizeof (float) * samples);
+  lyd_vm_set_param (filter, "hz", (double)lyd->sample_rate / frame);
+  for (i = 0; i < samples; i++)
+    {
+      lyd_vm_set_param (filter, "x",
+                        samples > 1 ? -1.0 + 2.0 * i / (samples - 1) : 0.0);
+      lyd_vm_set_param (filter, "position",
+                        frames > 1 ? (double)(i / frame) / (frames - 1) : 0.0);
+      lyd_filter_process (filter, NULL, 0, data + i, 1);
+    }
+  lyd_filter_free (filter);
+
+  lyd_load_wave (lyd, name, samples, lyd->sample_rate, data);
+  g_free (data);
+  return 0;
+}
+
 void
 lyd_set_wave_handler (Lyd *lyd,
                      int (*wave_handler) (Lyd *lyd, const char *wavename,
@@ -436,7 +825,6 @@ lyd_set_voice_count (Lyd *lyd, int voice_count)
 {
   lyd->voice_count = voice_count;
   lyd->i_voice_count = 1.0 / voice_count;
-  lyd->level = 0.0;
 }
 
 int lyd_get_voice_count (Lyd *lyd)
@@ -444,92 +832,6 @@ int lyd_get_voice_count (Lyd *lyd)
   return lyd->voice_count;
 }
 
-#define POOL_SIZE   28
-#define FULL_POOL   0xfffffff
-typedef struct AllocPool
-{
-  char      *alloc;
-  LydSample *mem;
-  long       used; /* bitmask of used bufs */
-} AllocPool;
-
-LydSample *lyd_chunk_new (Lyd *lyd)
-{
-  AllocPool *pool;
-  int no;
-  pthread_mutex_lock (&lyd->mmutex);
-  pool = lyd->chunk_pools?lyd->chunk_pools->data:NULL;
-  if (!pool || pool->used == FULL_POOL)
-    {
-      SList *iter;
-      for (iter = lyd->chunk_pools; iter; iter=iter->next)
-        {
-          pool = iter->data;
-          if (pool->used != FULL_POOL)
-            break;
-          pool = NULL;
-        }
-      if (!pool)
-        {
-          pool = g_new0 (AllocPool, 1);
-          lyd->chunk_pools = slist_prepend (lyd->chunk_pools, pool);
-          pool->alloc = g_malloc0 (sizeof (LydSample) * LYD_CHUNK * POOL_SIZE + LYD_ALIGN * 2);
-          /* align memory */
-          pool->mem = (void*) (pool->alloc) + (LYD_ALIGN-((long int)((char *)pool->alloc)) % LYD_ALIGN);
-        }
-    }
-  for (no = 0; no < POOL_SIZE; no++)
-    {
-      int bitmask = 1 << no;
-      if (!(pool->used & bitmask))
-        {
-          pool->used |= bitmask;
-          pthread_mutex_unlock (&lyd->mmutex);
-          return (LydSample*) &pool->mem[LYD_CHUNK * no];
-        }
-    }
-  pthread_mutex_unlock (&lyd->mmutex);
-  return NULL;
-}
-
-void lyd_chunk_free (Lyd *lyd, LydSample *chunk)
-{
-  SList *iter, *prev = NULL;
-  pthread_mutex_lock (&lyd->mmutex);
-  for (iter = lyd->chunk_pools; iter; prev = iter, iter = iter->next)
-    {
-      AllocPool *pool = iter->data;
-      if ((char*)(chunk) - (char*)(pool->mem) <
-          (int)POOL_SIZE * sizeof (LydSample) * LYD_CHUNK &&
-          (char*)(chunk) >= (char*)(pool->mem))
-        {
-          int no = (int)((char*)(chunk) - (char*)(pool->mem)) / (LYD_CHUNK * sizeof (LydSample));
-
-          if (pool->used & (1 << no))
-            {
-              pool->used ^= (1 << no);
-              if (pool->used == 0 && 0)
-                {
-                  if (lyd->chunk_pools == iter)
-                    lyd->chunk_pools = iter->next;
-                  if (prev)
-                    prev->next = iter->next;
-                  g_free (pool->alloc);
-                  g_free (pool);
-                  iter->next = NULL;
-                  slist_free (iter);
-                  /* the pool with freed item should perhaps move to the start of
-                   * the list to facilitate reuse as well as speeding up of
-                   * subsequent frees, overkill with lyds access patterns though
-                   */
-                }
-            }
-          pthread_mutex_unlock (&lyd->mmutex);
-          return;
-        }
-    }
-  pthread_mutex_unlock (&lyd->mmutex);
-}
 #ifdef LYD_EXTENDABLE
 
 static LydOpInfo *getinfo (Lyd *lyd, const char *name)
@@ -557,6 +859,7 @@ static LydOpInfo *getinfo (Lyd *lyd, const char *name)
       lyd->op_info = slist_prepend (lyd->op_info, info);
       info->op = lyd->last_op++;
     }
+  lyd->compile_version++;
   return info;
 }
 
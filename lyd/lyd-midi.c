@@ -768,12 +768,14 @@ void lyd_midi_note_on (LydMidi *midi, int channel, int note, int vol)
 
   midi->channel[channel].note_volume[note] = vol; 
   if (!midi->seeking){
-    voice = lyd_note_full (midi->lyd, midi->channel[channel].patch,
-                           midi2hz (corrected_note + (bend / 8192.0) * 2),
-                           sort_out_volume (midi, channel, vol) / 127.0,
-                           4.0, /* max duration of 4s to avoid stuck notes */
-                           (midi->channel[channel].pan-64)/127.0,
-                           hashkey);
+    char strip[16];
+    sprintf (strip, "channel %d", channel + 1);
+    voice = lyd_note_bus (midi->lyd, midi->channel[channel].patch,
+                          midi2hz (corrected_note + (bend / 8192.0) * 2),
+                          sort_out_volume (midi, channel, vol) / 127.0,
+                          4.0, /* max duration of 4s to avoid stuck notes */
+                          (midi->channel[channel].pan-64)/127.0,
+                          hashkey, strip);
     midi->channel[channel].note_voice[note] = voice;
   }
 }
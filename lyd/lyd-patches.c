@@ -19,6 +19,7 @@
 #include <math.h>
 #include <string.h>
 #include "general-midi.inc"
+#include "core/lyd-private.h"
 
 static LydProgram *midi_programs[128] = {NULL, };
 
@@ -38,6 +39,23 @@ void lyd_set_patch (Lyd *lyd,
   midi_programs[no] = lyd_compile (lyd, patch);
 }
 
+LydVM *lyd_note_bus (Lyd        *lyd,
+                     int         patch,
+                     float       hz,
+                     float       volume,
+                     float       duration,
+                     float       pan,
+                     int         hashkey,
+                     const char *bus)
+{
+  if (!midi_programs[patch])
+    midi_programs[patch] = lyd_compile (lyd, midi_patches[patch]);
+  if (!midi_programs[patch])
+    return NULL;
+  return lyd_voice_new_note (lyd, midi_programs[patch], hz, volume, duration,
+                             pan, hashkey, bus);
+}
+
 LydVM *lyd_note_full (Lyd  *lyd,
                       int   patch,
                       float hz,
@@ -46,18 +64,7 @@ LydVM *lyd_note_full (Lyd  *lyd,
                       float pan,
                       int   hashkey)
 {
-  LydVM *voice;
-  if (!midi_programs[patch])
-    midi_programs[patch] = lyd_compile (lyd, midi_patches[patch]);
-  if (!midi_programs[patch])
-    return NULL;
-  voice = lyd_voice_new (lyd, midi_programs[patch], 0.0, hashkey);
-
-  lyd_voice_set_param (voice, "volume", volume);
-  lyd_voice_set_param (voice, "hz", hz);
-  lyd_voice_set_duration (voice, duration);
-  lyd_voice_set_position (voice, pan);
-  return voice;
+  return lyd_note_bus (lyd, patch, hz, volume, duration, pan, hashkey, NULL);
 }
 
 LydVM *lyd_note (Lyd *lyd,
@@ -80,9 +80,16 @@ int         lyd_get_sample_rate (Lyd *lyd);
  */
 typedef enum {
   LYD_f32,  /* 32bit floating point mono */
-  LYD_f32S, /* 32bit floating point stereo, stream2 is used */
+  LYD_f32S, /* 32bit floating point stereo, stream2 is used, lyd mixes
+               directly into these buffers */
   LYD_s16,  /* 16bit signed integer mono on stream1 */
-  LYD_s16S  /* 16bit signed integer stereo, interleaved on stream1*/
+  LYD_s16S, /* 16bit signed integer stereo, interleaved on stream1*/
+  LYD_f32I, /* 32bit floating point stereo, interleaved on stream1 */
+  LYD_s24S, /* 24bit signed integer stereo in the low bits of 32bit words,
+               interleaved on stream1 */
+  LYD_s32S, /* 32bit signed integer stereo, interleaved on stream1 */
+  LYD_f32N  /* 32bit floating point, all channels set with
+               lyd_set_channels interleaved on stream1 */
 } LydFormat;
 /**
  * lyd_set_format:
@@ -99,12 +106,32 @@ void        lyd_set_format      (Lyd *lyd, LydFormat format);
  * Get the current sample format used by lyd engine.
  */
 LydFormat   lyd_get_format      (Lyd *lyd);
+/**
+ * lyd_set_channels:
+ * @lyd: lyd engine
+ * @channels: number of speakers, 1 to 8
+ *
+ * Sets the number of speakers voices are panned across, spread evenly from
+ * position -1.0 to 1.0, the default is 2. All of them are written by
+ * LYD_f32N, the other formats use the first two channels and the mono ones
+ * average those.
+ *
+ * Returns: 0 on success, -1 if the count is out of range.
+ */
+int         lyd_set_channels    (Lyd *lyd, int channels);
+/**
+ * lyd_get_channels:
+ * @lyd: lyd engine
+ *
+ * Returns: the number of speakers voices are panned across.
+ */
+int         lyd_get_channels    (Lyd *lyd);
 
 /**
  * lyd_synthesize:
  * @lyd: lyd engine
  * @len: number of samples to synthesize
- * @stream: output buffer stream (used for all mono, and 16bit interleaved stereo formats)
+ * @stream: output buffer stream (used for all mono, and interleaved stereo formats)
  * @stream2: second output buffer for floating point stereo
  *
  * Synthesize a number of samples from lyd writing into the buffers provided. You do not
@@ -129,6 +156,11 @@ typedef struct _LydProgram LydProgram;
  * Compiles a \0 terminated string to a LydProgram, an intermediate compact binary form
  * that can be instantiated into voices with lyd_voice_new.
  *
+ * Recently compiled programs are kept by @lyd, compiling the same source
+ * again, regardless of spacing and comments, returns a new reference to the
+ * same program. Each returned program is still released with
+ * lyd_program_free. No programs are shared while a var handler is set.
+ *
  * Returns: a LydProgram if copmpilation was successful, NULL if compilation failed.
  */
 LydProgram *lyd_compile         (Lyd *lyd, const char *source);
@@ -136,7 +168,8 @@ LydProgram *lyd_compile         (Lyd *lyd, const char *source);
  * lyd_program_free:
  * @program: a lyd program
  *
- * Frees all the data consumed by a LydProgram
+ * Frees all the data consumed by a LydProgram, voices created from it keep
+ * it alive until they are done.
  */
 void        lyd_program_free    (LydProgram *program);
 
@@ -164,7 +197,9 @@ typedef LydVM LydVoice;
  *
  * Create a new voice, potentially delayed from a compiled LydProgram
  *
- * Returns: a LydVoice a fully opaque handle to a voice.
+ * Returns: a LydVoice a fully opaque handle to a voice, or NULL if the
+ * memory budget set with lyd_set_memory_budget is exhausted. The functions
+ * taking a voice accept NULL and do nothing with it.
  */
 LydVoice   *lyd_voice_new       (Lyd *lyd, LydProgram *program, double delay, int tag);
 /**
@@ -219,10 +254,32 @@ LydVoice   *lyd_voice_set_duration (LydVoice *voice, double duration);
  * @voice: voice handle
  * @position: panning position between -1.0 and 1.0.
  *
- * Sets the stereo position of a voice, 0.0 is center.
+ * Sets the stereo position of a voice, 0.0 is center. A voice on a
+ * speaker plays at full level there, in stereo a centered voice plays at
+ * 0.707 on both.
  */
 LydVoice   *lyd_voice_set_position (LydVoice *voice,
                                     double    position);
+/**
+ * lyd_voice_set_bus:
+ * @voice: voice handle
+ * @bus: name of a bus created with lyd_set_bus, or NULL
+ *
+ * Mixes the voice into the named bus instead of directly into the master
+ * mix, unknown names and NULL select the master mix.
+ */
+LydVoice   *lyd_voice_set_bus (LydVoice *voice, const char *bus);
+/**
+ * lyd_voice_set_send:
+ * @voice: voice handle
+ * @bus: name of a bus created with lyd_set_bus, or NULL to remove the send
+ * @amount: level of the send
+ *
+ * Additionally mixes the voice, scaled by amount, into a bus. Useful for
+ * sharing a single reverb among many voices.
+ */
+LydVoice   *lyd_voice_set_send (LydVoice *voice, const char *bus,
+                                double amount);
 
 /**
  * lyd_voice_set_param:
@@ -298,11 +355,34 @@ void lyd_vm_set_param_delayed (LydVM *vm,
  *
  * Loads PCM data in memory into a the wavetable entry wavename, this
  * pcm data can be used as an oscillator with wave('wavename') and
- * wave_loop('wavename').
+ * wave_loop('wavename'). Entries can also hold tables for ops, like the
+ * ratio and amplitude pairs of additive(hz, 'wavename').
  */
 void        lyd_load_wave (Lyd *lyd, const char *wavename,
                            int  samples, int sample_rate,
                            float *data);
+/**
+ * lyd_load_wave_expression:
+ * @lyd: lyd engine
+ * @wavename: name for wave
+ * @samples: number of samples
+ * @code: lyd expression computing the samples
+ *
+ * Fills the wavetable entry wavename with samples values of a lyd
+ * expression, for tables used by shape() and wavetable(). The variable x
+ * goes from -1.0 to 1.0 over the table, 'x / (1 + abs (x))' makes a soft
+ * clipping curve. The variable hz is the frequency at which oscillators
+ * do one cycle per wavetable() frame, and position goes from 0.0 for the
+ * first frame to 1.0 for the last, with 8 * 2048 samples
+ * 'saw (hz) * (1 - position) + square (hz) * position' makes a table
+ * morphing from saw to square.
+ *
+ * Returns: 0 on success, -1 if code failed to compile.
+ */
+int         lyd_load_wave_expression (Lyd        *lyd,
+                                      const char *wavename,
+                                      int         samples,
+                                      const char *code);
 /**
  * lyd_set_wave_handler:
  * @lyd: lyd engine
@@ -405,6 +485,81 @@ void        lyd_filter_free     (LydFilter *filter);
  */
 void        lyd_set_global_filter (Lyd *lyd, LydProgram *program);
 
+/**
+ * lyd_set_bus:
+ * @lyd: lyd engine
+ * @name: name of the bus
+ * @effect: program processing the bus, reading its input with input(0),
+ *          or NULL to pass the sum through
+ * @output: name of the bus the result is mixed into, NULL for the master mix
+ *
+ * Creates a named effect bus, or reconfigures an existing one. Voices and
+ * other buses mix into it, and the effect runs once per channel for each
+ * period no matter how many voices feed it. The MIDI player routes voices
+ * of channel n to a bus named "channel n" (1-16) when it exists.
+ *
+ * Returns: 0 on success, -1 if the name is NULL, the output does not
+ * exist, would form a loop or there are too many buses.
+ */
+int         lyd_set_bus (Lyd *lyd, const char *name,
+                         LydProgram *effect, const char *output);
+
+/**
+ * lyd_set_global:
+ * @lyd: lyd engine
+ * @name: name of the modulator
+ * @program: a compiled LydProgram, or NULL for silence
+ *
+ * Defines or replaces an engine-global modulator. It is computed once per
+ * period, and voices read it with global(name) instead of each running
+ * their own copy, keeping LFOs in sync across voices. Programs can also
+ * declare one with global(name, expression), which is ignored when the
+ * name already exists.
+ *
+ * Returns: 0 on success, -1 if there are too many global modulators.
+ */
+int         lyd_set_global (Lyd *lyd, const char *name, LydProgram *program);
+
+/**
+ * lyd_set_pipelined:
+ * @lyd: lyd engine
+ * @pipelined: 1 to enable, 0 to disable
+ *
+ * In pipelined mode the buses, global filter, limiter and output conversion
+ * of a period run on a dedicated thread while the voices of the next period
+ * are rendered. lyd_synthesize then returns audio one period late, the
+ * first period after enabling it or changing the period size is silent.
+ */
+void        lyd_set_pipelined (Lyd *lyd, int pipelined);
+
+/**
+ * lyd_set_note_cache:
+ * @lyd: lyd engine
+ * @bytes: memory to use for cached notes, 0 disables the cache
+ *
+ * Keeps the rendered samples of notes that played out untouched, so that
+ * later voices of the same program with the same variables and duration
+ * replay them instead of computing them. Only programs without noise,
+ * pluck, inputs or global modulators are cached, and a voice that gets
+ * released early or has parameters changed goes back to computing its
+ * samples. The cache is disabled by default.
+ */
+void        lyd_set_note_cache (Lyd *lyd, long bytes);
+
+/**
+ * lyd_get_note_cache_stats:
+ * @lyd: lyd engine
+ * @hits: return location for the number of voices that replayed a note, or NULL
+ * @misses: return location for the number of voices that were recorded, or NULL
+ * @bytes: return location for the memory used by cached notes, or NULL
+ *
+ * Reports how effective the note cache is.
+ */
+void        lyd_get_note_cache_stats (Lyd  *lyd,
+                                      long *hits,
+                                      long *misses,
+                                      long *bytes);
+
 /**
  * lyd_add_pre_cb:
  * @lyd: lyd engine
@@ -515,6 +670,25 @@ LydVoice *lyd_note (Lyd *lyd, int patch, float hz, float volume, float duration)
 LydVoice *lyd_note_full (Lyd *lyd, int patch, float hz, float volume,
                          float duration, float pan, int tag);
 
+/**
+ * lyd_note_bus:
+ * @lyd: lyd engine
+ * @patch: patch no
+ * @hz: hz to play at,
+ * @volume: volume to play at
+ * @duration: duration to play for.
+ * @pan: position -1.0 .. 1.0  0.0 is center
+ * @tag: tag to apply to created notes.
+ * @bus: name of the effect bus to play on, or NULL for the master mix.
+ *
+ * Like lyd_note_full, also routing the note to an effect bus, see
+ * lyd_voice_set_bus. The note is only started once all of it is set.
+ *
+ * Returns: a voice handle, or NULL when over the memory budget.
+ */
+LydVoice *lyd_note_bus (Lyd *lyd, int patch, float hz, float volume,
+                        float duration, float pan, int tag, const char *bus);
+
 
 
 
@@ -583,6 +757,45 @@ void         lyd_mic_add_data (Lyd *lyd, const char *mic_name,
                                int nsamples, float *buffer);
 
 
+/**
+ * lyd_trim:
+ * @lyd: lyd engine
+ *
+ * Return memory no longer used by voices to the system, lyd keeps freed
+ * memory around for reuse by new voices until this is called.
+ *
+ * Returns: the number of bytes released.
+ */
+long         lyd_trim (Lyd *lyd);
+
+/**
+ * lyd_get_memory_used:
+ * @lyd: lyd engine
+ *
+ * Returns: bytes currently allocated by lyd for voice buffers and delay lines.
+ */
+long         lyd_get_memory_used (Lyd *lyd);
+
+/**
+ * lyd_set_memory_budget:
+ * @lyd: lyd engine
+ * @bytes: maximum memory use, 0 for no limit (the default)
+ *
+ * Limit the memory used for voices, when the budget is exceeded lyd first
+ * trims and then refuses to create new voices until memory is freed.
+ */
+void         lyd_set_memory_budget (Lyd *lyd, long bytes);
+
+/**
+ * lyd_set_hugepages:
+ * @lyd: lyd engine
+ * @enabled: whether to back voice memory with huge pages
+ *
+ * Request huge pages (MAP_HUGETLB, falling back to transparent huge pages)
+ * for memory allocated after this call, reducing TLB misses with many voices.
+ */
+void         lyd_set_hugepages (Lyd *lyd, int enabled);
+
 /**
  * lyd_vm_set_complete_cb:
  * @vm: a voice/instance to register a complete callback
@@ -0,0 +1,42 @@
+/* past the memory budget lyd_voice_new refuses voices, and the functions
+ * taking a voice accept the NULL it returns
+ */
+
+#include <lyd/lyd.h>
+#include <stdio.h>
+
+int main (void)
+{
+  Lyd        *lyd = lyd_new ();
+  LydProgram *program = lyd_compile (lyd, "low_pass (saw (hz=440), 800, 0.5)");
+  LydVoice   *voice;
+  float       buf[512];
+  int         i;
+
+  lyd_set_format (lyd, LYD_f32);
+  for (i = 0; i < 8; i++)
+    lyd_voice_new (lyd, program, 0.0, 0);
+  lyd_synthesize (lyd, 512, buf, NULL);
+
+  lyd_set_memory_budget (lyd, 1);
+  voice = lyd_voice_new (lyd, program, 0.0, 0);
+  if (voice)
+    {
+      printf ("FAIL voice created past the memory budget\n");
+      return 1;
+    }
+  lyd_voice_set_param (voice, "hz", 220.0);
+  lyd_voice_set_param_delayed (voice, "hz", 0.5, LYD_LINEAR, 330.0);
+  lyd_voice_set_duration (voice, 1.0);
+  lyd_voice_set_delay (voice, 0.1);
+  lyd_voice_set_position (voice, 0.5);
+  lyd_voice_set_bus (voice, "none");
+  lyd_voice_set_send (voice, "none", 0.5);
+  lyd_voice_release (voice);
+  lyd_voice_kill (voice);
+  lyd_synthesize (lyd, 512, buf, NULL);
+
+  lyd_program_free (program);
+  lyd_free (lyd);
+  return 0;
+}
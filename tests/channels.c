@@ -0,0 +1,106 @@
+/* voices panned across more than two speakers land on the expected ones */
+
+#include <lyd/lyd.h>
+#include <stdio.h>
+#include <math.h>
+
+#define PERIOD 256
+
+static int failed = 0;
+
+/* energy of each of channels interleaved channels of a voice at position */
+static void render (Lyd        *lyd,
+                    LydProgram *program,
+                    float       position,
+                    int         channels,
+                    double     *energy)
+{
+  static float buf[PERIOD * 8], buf2[PERIOD];
+  LydVoice *voice = lyd_voice_new (lyd, program, 0.0, 1);
+  int       period, i, c;
+
+  lyd_voice_set_position (voice, position);
+  for (c = 0; c < channels; c++)
+    energy[c] = 0.0;
+  for (period = 0; period < 20; period++)
+    {
+      lyd_synthesize (lyd, PERIOD, buf, buf2);
+      if (period == 0) /* the limiter delay still holds the previous voice */
+        continue;
+      for (i = 0; i < PERIOD; i++)
+        for (c = 0; c < channels; c++)
+          energy[c] += buf[i * channels + c] * buf[i * channels + c];
+    }
+  lyd_kill (lyd, 1);
+}
+
+/* only channel loud, or loud and the next one equally, carries sound, a
+ * voice on a speaker at full level and halfway between two at 0.707 */
+static void expect (const char *what, double *energy, int channels,
+                    int loud, int shared)
+{
+  double full = 0.5 * 0.5 / 2 * PERIOD * 19; /* of sin (440) * 0.5 */
+  double level = shared ? full * 0.5 : full;
+  int    c;
+
+  if (fabs (energy[loud] / level - 1.0) > 0.02)
+    {
+      printf ("FAIL %s: channel %d energy %f, expected %f\n",
+              what, loud, energy[loud], level);
+      failed = 1;
+    }
+  for (c = 0; c < channels; c++)
+    {
+      int    on = c == loud || (shared && c == loud + 1);
+      double ratio = energy[c] / (energy[loud] + 1e-20);
+      if (energy[loud] < 1.0 || (on ? fabs (ratio - 1.0) > 0.01 : ratio > 1e-6))
+        {
+          printf ("FAIL %s: channel %d energy %f, channel %d %f\n",
+                  what, c, energy[c], loud, energy[loud]);
+          failed = 1;
+        }
+    }
+}
+
+int main (void)
+{
+  Lyd        *lyd = lyd_new ();
+  LydProgram *program = lyd_compile (lyd, "sin(440) * 0.5");
+  double      energy[8];
+
+  lyd_set_voice_count (lyd, 1);
+  lyd_set_format (lyd, LYD_f32N);
+  if (lyd_get_channels (lyd) != 2 ||
+      lyd_set_channels (lyd, 0) == 0 || lyd_set_channels (lyd, 9) == 0 ||
+      lyd_set_channels (lyd, 4) != 0 || lyd_get_channels (lyd) != 4)
+    {
+      printf ("FAIL channel count not set\n");
+      failed = 1;
+    }
+
+  render (lyd, program, -1.0, 4, energy);
+  expect ("4 channels, left", energy, 4, 0, 0);
+  render (lyd, program, 1.0 / 3, 4, energy);
+  expect ("4 channels, third speaker", energy, 4, 2, 0);
+  render (lyd, program, 1.0, 4, energy);
+  expect ("4 channels, right", energy, 4, 3, 0);
+  render (lyd, program, 0.0, 4, energy);
+  expect ("4 channels, center", energy, 4, 1, 1);
+
+  lyd_set_channels (lyd, 8);
+  render (lyd, program, 1.0, 8, energy);
+  expect ("8 channels, right", energy, 8, 7, 0);
+
+  lyd_set_channels (lyd, 1);
+  render (lyd, program, -1.0, 1, energy);
+  expect ("mono", energy, 1, 0, 0);
+
+  lyd_set_channels (lyd, 2);
+  lyd_set_format (lyd, LYD_f32I);
+  render (lyd, program, 1.0, 2, energy);
+  expect ("stereo, right", energy, 2, 1, 0);
+
+  lyd_program_free (program);
+  lyd_free (lyd);
+  return failed;
+}
@@ -0,0 +1,108 @@
+/* the built in bank, written with fm(), sounds like the plain expressions it
+ * was converted from, kept in general-midi-reference.txt
+ */
+
+#include <lyd/lyd.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define PERIOD   256
+#define PERIODS  128  /* a note of half a second, and some of its release */
+
+static Lyd *bank_lyd (void)
+{
+  Lyd *lyd = lyd_new ();
+  lyd_set_format (lyd, LYD_f32);
+  lyd_set_voice_count (lyd, 1);
+  return lyd;
+}
+
+static int read_patch (FILE *file, char *patch, int size)
+{
+  if (!fgets (patch, size, file))
+    return 0;
+  patch[strcspn (patch, "\n")] = '\0';
+  return 1;
+}
+
+static void render (Lyd *lyd, const char *patch, float *out)
+{
+  LydProgram *program = lyd_compile (lyd, patch);
+  LydVoice   *voice;
+  int         period;
+
+  memset (out, 0, sizeof (float) * PERIOD * PERIODS);
+  if (!program)
+    return;
+  voice = lyd_voice_new (lyd, program, 0.0, 1);
+  lyd_voice_set_param (voice, "volume", 0.8);
+  lyd_voice_set_param (voice, "hz", 440.0);
+  lyd_voice_set_duration (voice, 0.5);
+  for (period = 0; period < PERIODS; period++)
+    lyd_synthesize (lyd, PERIOD, out + period * PERIOD, NULL);
+  lyd_kill (lyd, 1);
+  lyd_program_free (program);
+}
+
+int main (void)
+{
+  static float bank[PERIOD * PERIODS], reference[PERIOD * PERIODS];
+  char  patch[4096], reference_patch[4096];
+  FILE *bank_file = fopen (LYD_SRCDIR "/general-midi.txt", "r");
+  FILE *reference_file = fopen (LYD_SRCDIR "/general-midi-reference.txt", "r");
+  Lyd  *a = bank_lyd ();
+  Lyd  *b = bank_lyd ();
+  int   no, failed = 0;
+
+  if (!bank_file || !reference_file)
+    {
+      printf ("FAIL opening the banks in %s\n", LYD_SRCDIR);
+      return 1;
+    }
+
+  for (no = 0; no < 128; no++)
+    {
+      double energy = 0.0, error = 0.0;
+      int    noisy, i;
+
+      if (!read_patch (bank_file, patch, sizeof (patch)) ||
+          !read_patch (reference_file, reference_patch,
+                       sizeof (reference_patch)))
+        {
+          printf ("FAIL bank ends before patch %d\n", no);
+          return 1;
+        }
+      noisy = strstr (reference_patch, "noise") ||
+              strstr (reference_patch, "pluck");
+      render (a, patch, bank);
+      render (b, reference_patch, reference);
+
+      for (i = 0; i < PERIOD * PERIODS; i++)
+        {
+          energy += reference[i] * reference[i];
+          if (noisy)
+            error += bank[i] * bank[i];
+          else
+            error += (bank[i] - reference[i]) * (bank[i] - reference[i]);
+        }
+      /* rounding differs, as do single samples at waveform discontinuities.
+       * Patches excited by noise draw from one shared sequence, their level
+       * varies several times from note to note and only has to be in the
+       * same range */
+      if (energy == 0.0 ||
+          (noisy ? error < energy * 0.1 || error > energy * 10.0
+                 : error > energy * 1e-6))
+        {
+          printf ("FAIL patch %d: energy %f, difference %f\n",
+                  no, energy, error);
+          failed = 1;
+        }
+    }
+
+  fclose (bank_file);
+  fclose (reference_file);
+  lyd_free (a);
+  lyd_free (b);
+  return failed;
+}
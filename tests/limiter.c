@@ -0,0 +1,49 @@
+/* the master limiter keeps peaks below its ceiling also when the period
+ * size is not a multiple of its lookahead block
+ */
+
+#include <lyd/lyd.h>
+#include <core/lyd-private.h>
+#include <stdio.h>
+#include <math.h>
+
+static int check (int period)
+{
+  Lyd        *lyd = lyd_new ();
+  LydProgram *program;
+  float       buf[2048 * 2], peak = 0.0;
+  int         done, i;
+
+  lyd_set_voice_count (lyd, 1);
+  lyd_set_format (lyd, LYD_f32I);
+  /* bursts of loud noise, with onsets landing anywhere in a block */
+  program = lyd_compile (lyd, "noise() * (square(13.7) + 1.0) * 4.0");
+  lyd_voice_new (lyd, program, 0.0, 0);
+
+  for (done = 0; done < 44100 * 2; done += period)
+    {
+      lyd_synthesize (lyd, period, buf, NULL);
+      for (i = 0; i < period * 2; i++)
+        peak = fabsf (buf[i]) > peak ? fabsf (buf[i]) : peak;
+    }
+  lyd_program_free (program);
+  lyd_free (lyd);
+
+  if (peak > LYD_LIMITER_CEILING + 1e-4)
+    {
+      printf ("FAIL period %d: peak %f above ceiling %f\n",
+              period, peak, LYD_LIMITER_CEILING);
+      return 1;
+    }
+  return 0;
+}
+
+int main (void)
+{
+  int failed = 0;
+  failed |= check (441);
+  failed |= check (512);
+  failed |= check (17);
+  failed |= check (2047);
+  return failed;
+}
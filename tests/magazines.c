@@ -0,0 +1,72 @@
+/* a thread that rendered with a lyd that since was freed can go on using
+ * another lyd, without the chunks cached for the first being handed back
+ */
+
+#include <lyd/lyd.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#define PERIOD 512
+
+static void play (Lyd *lyd)
+{
+  static float buf[PERIOD * 2];
+  LydProgram  *program = lyd_compile (lyd,
+                           "low_pass (sin (440) + saw (220), 1000, 0.5)");
+  int          i;
+
+  for (i = 0; i < 8; i++)
+    lyd_voice_new (lyd, program, 0.0, 1);
+  for (i = 0; i < 20; i++)
+    lyd_synthesize (lyd, PERIOD, buf, NULL);
+  lyd_kill (lyd, 1);
+  for (i = 0; i < 4; i++)
+    lyd_synthesize (lyd, PERIOD, buf, NULL);
+  lyd_program_free (program);
+}
+
+static pthread_barrier_t barrier;
+static Lyd              *a;
+
+/* renders with a, waits for the main thread to free it, then renders
+ * with a new lyd */
+static void *worker (void *data)
+{
+  Lyd *b;
+
+  a = lyd_new ();
+  lyd_set_format (a, LYD_f32I);
+  play (a);
+  pthread_barrier_wait (&barrier);
+  pthread_barrier_wait (&barrier);
+
+  b = lyd_new ();
+  lyd_set_format (b, LYD_f32I);
+  play (b);
+  lyd_free (b);
+  return data;
+}
+
+int main (void)
+{
+  pthread_t thread;
+  Lyd      *lyd;
+
+  pthread_barrier_init (&barrier, NULL, 2);
+  if (pthread_create (&thread, NULL, worker, NULL))
+    {
+      printf ("FAIL creating thread\n");
+      return 1;
+    }
+  pthread_barrier_wait (&barrier);
+  lyd_free (a);
+  pthread_barrier_wait (&barrier);
+  pthread_join (thread, NULL);
+
+  /* and the main thread, after the worker exited */
+  lyd = lyd_new ();
+  lyd_set_format (lyd, LYD_f32I);
+  play (lyd);
+  lyd_free (lyd);
+  return 0;
+}
@@ -0,0 +1,149 @@
+/* replaying cached notes, and not replaying them once a wave they read has
+ * been replaced; notes released early are replayed when released at the
+ * same point, and sound as if uncached when released elsewhere
+ */
+
+#include <lyd/lyd.h>
+#include <stdio.h>
+#include <math.h>
+
+#define PERIOD 512
+#define NOTE_PERIODS 250
+
+static void load (Lyd *lyd, float level)
+{
+  float data[1024];
+  int   i;
+  for (i = 0; i < 1024; i++)
+    data[i] = level * sinf (i * 2 * M_PI / 64);
+  lyd_load_wave (lyd, "w", 1024, 44100, data);
+}
+
+/* peak level of a short note, rendered until it has been silent long
+ * enough to end and be stored */
+static float play (Lyd *lyd, LydProgram *program)
+{
+  float     buf[PERIOD], peak = 0.0;
+  LydVoice *voice = lyd_voice_new (lyd, program, 0.0, 0);
+  int       period, i;
+
+  lyd_voice_set_duration (voice, 0.05);
+  for (period = 0; period < 250; period++)
+    {
+      lyd_synthesize (lyd, PERIOD, buf, NULL);
+      for (i = 0; i < PERIOD; i++)
+        peak = fabsf (buf[i]) > peak ? fabsf (buf[i]) : peak;
+    }
+  return peak;
+}
+
+/* a note released after release periods, and given a longer duration
+ * after change periods */
+static void play_released (Lyd *lyd, LydProgram *program, int release,
+                           int change, float *out)
+{
+  LydVoice *voice = lyd_voice_new (lyd, program, 0.0, 0);
+  int       period;
+
+  lyd_voice_set_duration (voice, 1.0);
+  for (period = 0; period < NOTE_PERIODS; period++)
+    {
+      if (period == release)
+        lyd_voice_release (voice);
+      if (period == change)
+        lyd_voice_set_duration (voice, 2.0);
+      lyd_synthesize (lyd, PERIOD, out + period * PERIOD, NULL);
+    }
+}
+
+static int released (void)
+{
+  static const int releases[] = {10, 10, 20, 5, 20, 10};
+  static const int changes[]  = {-1, -1, -1, -1, -1, 30};
+  static float cached[PERIOD * NOTE_PERIODS], plain[PERIOD * NOTE_PERIODS];
+  const char *code = "echo (0.5, 0.1, sin (440) * adsr (0.01, 0.05, 0.5, 0.1)"
+                     " * 0.3)";
+  Lyd        *lyd = lyd_new (), *reference = lyd_new ();
+  LydProgram *program = lyd_compile (lyd, code);
+  LydProgram *reference_program = lyd_compile (reference, code);
+  long        hits;
+  int         i, n, failed = 0;
+
+  lyd_set_format (lyd, LYD_f32);
+  lyd_set_format (reference, LYD_f32);
+  lyd_set_note_cache (lyd, 4 << 20);
+  for (n = 0; n < 6; n++)
+    {
+      float diff = 0.0;
+      play_released (lyd, program, releases[n], changes[n], cached);
+      play_released (reference, reference_program, releases[n], changes[n],
+                     plain);
+      for (i = 0; i < PERIOD * NOTE_PERIODS; i++)
+        diff = fmaxf (diff, fabsf (cached[i] - plain[i]));
+      if (diff > 1e-5)
+        {
+          printf ("FAIL note %d released after %d periods off by %f\n",
+                  n, releases[n], diff);
+          failed = 1;
+        }
+    }
+  lyd_get_note_cache_stats (lyd, &hits, NULL, NULL);
+  if (hits != 6) /* all but the first start replaying, the fifth to its end,
+                    and the last changes to the one released where it is */
+    {
+      printf ("FAIL released notes replayed %ld times\n", hits);
+      failed = 1;
+    }
+
+  lyd_program_free (program);
+  lyd_program_free (reference_program);
+  lyd_free (lyd);
+  lyd_free (reference);
+  return failed;
+}
+
+int main (void)
+{
+  Lyd        *lyd = lyd_new ();
+  LydProgram *program;
+  float       first, again, reloaded;
+  long        hits, misses;
+
+  lyd_set_format (lyd, LYD_f32);
+  lyd_set_note_cache (lyd, 1 << 20);
+  load (lyd, 0.5);
+  program = lyd_compile (lyd, "wave ('w')");
+
+  first = play (lyd, program);
+  again = play (lyd, program);
+  lyd_get_note_cache_stats (lyd, &hits, &misses, NULL);
+  if (hits != 1 || fabsf (first - again) > 1e-6)
+    {
+      printf ("FAIL note not replayed: %ld hits, %f against %f\n",
+              hits, again, first);
+      return 1;
+    }
+
+  load (lyd, 0.25);
+  reloaded = play (lyd, program);
+  if (fabsf (reloaded - first * 0.5) > 0.01)
+    {
+      printf ("FAIL replaced wave played at %f, expected %f\n",
+              reloaded, first * 0.5);
+      return 1;
+    }
+
+  lyd_program_free (program);
+
+  /* loading its inline table leaves the compiled program current */
+  program = lyd_compile (lyd, "additive (440, '1 1.0  2 0.5')");
+  if (lyd_compile (lyd, "additive (440, '1 1.0  2 0.5')") != program)
+    {
+      printf ("FAIL program with an inline table compiled again\n");
+      return 1;
+    }
+  lyd_program_free (program);
+  lyd_program_free (program);
+  lyd_free (lyd);
+  return released ();
+}
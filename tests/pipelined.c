@@ -0,0 +1,61 @@
+/* pipelined rendering gives the same output as direct rendering, one period
+ * late, also for bus effects and the global filter reading global modulators
+ */
+
+#include <lyd/lyd.h>
+#include <stdio.h>
+#include <math.h>
+
+#define PERIOD  256
+#define PERIODS 40
+
+static void render (int pipelined, float *out)
+{
+  Lyd        *lyd = lyd_new ();
+  LydProgram *lfo, *tremolo, *filter, *voice;
+  float       left[PERIOD], right[PERIOD];
+  int         period, i;
+
+  lyd_set_format (lyd, LYD_f32S);
+  lyd_set_pipelined (lyd, pipelined);
+
+  lfo     = lyd_compile (lyd, "sin (7.0) * 0.5 + 0.5");
+  tremolo = lyd_compile (lyd, "input (0) * global (lfo)");
+  filter  = lyd_compile (lyd, "input (0) * (0.5 + global (lfo) * 0.5)");
+  voice   = lyd_compile (lyd, "sin (440.0) * 0.4");
+  lyd_set_global (lyd, "lfo", lfo);
+  lyd_set_bus (lyd, "tremolo", tremolo, NULL);
+  lyd_set_global_filter (lyd, filter);
+  lyd_voice_set_bus (lyd_voice_new (lyd, voice, 0.0, 0), "tremolo");
+
+  for (period = 0; period < PERIODS; period++)
+    {
+      lyd_synthesize (lyd, PERIOD, left, right);
+      for (i = 0; i < PERIOD; i++)
+        out[period * PERIOD + i] = left[i];
+    }
+
+  lyd_program_free (lfo);
+  lyd_program_free (tremolo);
+  lyd_program_free (filter);
+  lyd_program_free (voice);
+  lyd_free (lyd);
+}
+
+int main (void)
+{
+  static float direct[PERIOD * PERIODS], pipelined[PERIOD * PERIODS];
+  float        diff = 0.0;
+  int          i;
+
+  render (0, direct);
+  render (1, pipelined);
+  for (i = 0; i < PERIOD * (PERIODS - 1); i++)
+    diff = fmaxf (diff, fabsf (direct[i] - pipelined[i + PERIOD]));
+  if (diff > 1e-5)
+    {
+      printf ("FAIL pipelined output differs by %f\n", diff);
+      return 1;
+    }
+  return 0;
+}
@@ -0,0 +1,51 @@
+/* a voice reusing the vm of a killed one starts out like a fresh voice,
+ * not with what the previous one left in its buffers
+ */
+
+#include <lyd/lyd.h>
+#include <stdio.h>
+#include <math.h>
+
+#define PERIOD 512
+
+static float level (Lyd *lyd, LydProgram *program, float time)
+{
+  float     buf[PERIOD], peak = 0.0;
+  LydVoice *voice = lyd_voice_new (lyd, program, 0.0, 1);
+  int       period, i;
+
+  /* without a delay time echo leaves its output alone */
+  lyd_voice_set_param (voice, "time", time);
+  for (period = 0; period < 4; period++)
+    {
+      lyd_synthesize (lyd, PERIOD, buf, NULL);
+      if (period == 0) /* the limiter delay still holds the previous voice */
+        continue;
+      for (i = 0; i < PERIOD; i++)
+        peak = fabsf (buf[i]) > peak ? fabsf (buf[i]) : peak;
+    }
+  lyd_kill (lyd, 1);
+  return peak;
+}
+
+int main (void)
+{
+  Lyd        *lyd = lyd_new ();
+  LydProgram *program = lyd_compile (lyd, "echo (0.5, time=0.01, sin (440))");
+  float       fresh, used, recycled;
+
+  lyd_set_format (lyd, LYD_f32);
+  fresh = level (lyd, program, 0.0);
+  used = level (lyd, program, 0.01);
+  recycled = level (lyd, program, 0.0);
+
+  if (used < 0.01 || recycled != fresh)
+    {
+      printf ("FAIL recycled voice peaks at %f, a fresh one at %f\n",
+              recycled, fresh);
+      return 1;
+    }
+  lyd_program_free (program);
+  lyd_free (lyd);
+  return 0;
+}